@@ -1,9 +1,10 @@
 #include <windows.h>
 #include <iphlpapi.h>
 #include <iprtrmib.h>
+#include <stdarg.h>
 #include <stdio.h>
-#include <vector>
 #include "toolbox.h"
+#include "DHCPLiteEngine.h"
 
 const TCHAR ptsCRLF[] = TEXT("\r\n");
 const TCHAR ptsERRORPrefix[] = TEXT("ERROR %d: ");
@@ -17,120 +18,197 @@ const TCHAR ptsERRORPrefix[] = TEXT("ERROR %d: ");
 #define DWIPtoValue(dw) ((DWIP0(dw)<<24) | (DWIP1(dw)<<16) | (DWIP2(dw)<<8) | DWIP3(dw))
 #define DWValuetoIP(dw) ((DWIP0(dw)<<24) | (DWIP1(dw)<<16) | (DWIP2(dw)<<8) | DWIP3(dw))
 
-const char pcsServerName[] = "DHCPLite DHCP server";
-
 // Maximum size of a UDP datagram (see RFC 768)
 #define MAX_UDP_MESSAGE_SIZE ((65536)-8)
 // DHCP constants (see RFC 2131 section 4.1)
 #define DHCP_SERVER_PORT (67)
 #define DHCP_CLIENT_PORT (68)
-// Broadcast bit for flags field (RFC 2131 section 2)
-#define BROADCAST_FLAG (0x80)
-// For display of host name information
-#define MAX_HOSTNAME_LENGTH (256)
-// RFC 2131 section 2
-enum op_values
-{
-	op_BOOTREQUEST = 1,
-	op_BOOTREPLY = 2,
-};
-// RFC 2132 section 9.6
-enum option_values
-{
-	option_PAD = 0,
-	option_SUBNETMASK = 1,
-	option_HOSTNAME = 12,
-	option_REQUESTEDIPADDRESS = 50,
-	option_IPADDRESSLEASETIME = 51,
-	option_DHCPMESSAGETYPE = 53,
-	option_SERVERIDENTIFIER = 54,
-	option_CLIENTIDENTIFIER = 61,
-	option_END = 255,
+
+// The flight recorder keeps the outcome of the most recent DHCP messages in a
+// fixed-size ring (always on) so dropped messages can be diagnosed afterward
+#define FLIGHT_RECORDER_SIZE (4096)  // Must be a power of 2
+C_ASSERT(0 == (FLIGHT_RECORDER_SIZE & (FLIGHT_RECORDER_SIZE - 1)));
+
+#define FLIGHT_RECORDER_SIGNATURE (0x52464c44)  // "DLFR"
+#define FLIGHT_RECORDER_VERSION (1)
+struct FlightRecorderFileHeader
+{
+	DWORD dwSignature;
+	WORD wVersion;
+	WORD wRecordSize;
+	ULONGLONG qwFirstSequence;  // Sequence number of the first (oldest) record
+	DWORD dwRecords;
+	DWORD dwReserved;
 };
-enum DHCPMessageTypes
-{
-	DHCPMessageType_DISCOVER = 1,
-	DHCPMessageType_OFFER = 2,
-	DHCPMessageType_REQUEST = 3,
-	DHCPMessageType_DECLINE = 4,
-	DHCPMessageType_ACK = 5,
-	DHCPMessageType_NAK = 6,
-	DHCPMessageType_RELEASE = 7,
-	DHCPMessageType_INFORM = 8,
+C_ASSERT(24 == sizeof(FlightRecorderFileHeader));
+
+// Written only by the packet thread; record N is stored at [N % FLIGHT_RECORDER_SIZE]
+// and llRecorded is advanced after it is complete, so readers can tell which
+// records they copied intact
+struct FlightRecorder
+{
+	volatile LONG64 llRecorded;
+	LONGLONG llPerformanceFrequency;
+	FlightRecord pfrRecords[FLIGHT_RECORDER_SIZE];
 };
 
-// DHCP magic cookie values
-const BYTE pbDHCPMagicCookie[] = { 99, 130, 83, 99 };
+void InitializeFlightRecorder(FlightRecorder* const pfr)
+{
+	ASSERT(0 != pfr);
+	ZeroMemory(pfr, sizeof(*pfr));
+	LARGE_INTEGER liFrequency;
+	VERIFY(QueryPerformanceFrequency(&liFrequency));  // Always succeeds on Windows XP and later
+	pfr->llPerformanceFrequency = liFrequency.QuadPart;
+}
 
-struct AddressInUseInformation
+FlightRecord* BeginFlightRecord(FlightRecorder* const pfr, const BYTE* const pbData, const int iDataSize)
 {
-	DWORD dwAddrValue;
-	BYTE* pbClientIdentifier;
-	DWORD dwClientIdentifierSize;
-	// SYSTEMTIME stExpireTime;  // If lease timeouts are needed
-};
-typedef std::vector<AddressInUseInformation> VectorAddressInUseInformation;
+	ASSERT((0 != pfr) && ((0 == iDataSize) || (0 != pbData)));
+	FlightRecord* const pfrRecord = &(pfr->pfrRecords[pfr->llRecorded & (FLIGHT_RECORDER_SIZE - 1)]);
+	ZeroMemory(pfrRecord, sizeof(*pfrRecord));
+	FILETIME ftNow;
+	GetSystemTimeAsFileTime(&ftNow);
+	pfrRecord->qwTimestamp = (((ULONGLONG)ftNow.dwHighDateTime) << 32) | ftNow.dwLowDateTime;
+	// Record who sent the message even if it fails the initial checks
+	const DHCPMessage* const pdhcpmRequest = (DHCPMessage*)pbData;
+	if ((int)sizeof(*pdhcpmRequest) <= iDataSize)
+	{
+		pfrRecord->xid = pdhcpmRequest->xid;
+		CopyMemory(pfrRecord->chaddr, pdhcpmRequest->chaddr, sizeof(pfrRecord->chaddr));
+		pfrRecord->hlen = pdhcpmRequest->hlen;
+	}
+	return pfrRecord;
+}
 
-typedef bool(*FindIndexOfFilter)(const AddressInUseInformation& raiui, const void* const pvFilterData);
-int FindIndexOf(const VectorAddressInUseInformation* const pvAddressesInUse, const FindIndexOfFilter pFilter, const void* const pvFilterData)
+void EndFlightRecord(FlightRecorder* const pfr, FlightRecord* const pfrRecord, const LONGLONG llProcessingCounts)
 {
-	ASSERT((0 != pvAddressesInUse) && (0 != pFilter) && (0 != pvFilterData));
-	for (size_t i = 0; i < pvAddressesInUse->size(); i++)
+	ASSERT((0 != pfr) && (0 != pfrRecord));
+	pfrRecord->dwProcessingNanoseconds = (DWORD)min((llProcessingCounts * 1000000000) / pfr->llPerformanceFrequency, (LONGLONG)MAXDWORD);
+	InterlockedExchange64(&(pfr->llRecorded), pfr->llRecorded + 1);  // Publish (and avoid a torn 64-bit store on x86)
+}
+
+bool WriteAll(const HANDLE hFile, const void* const pvData, const DWORD dwSize)
+{
+	DWORD dwBytesWritten;
+	return (0 == dwSize) || (WriteFile(hFile, pvData, dwSize, &dwBytesWritten, 0) && (dwSize == dwBytesWritten));
+}
+
+bool WriteFlightRecorder(FlightRecorder* const pfr, const HANDLE hFile)
+{
+	ASSERT((0 != pfr) && (INVALID_HANDLE_VALUE != hFile));
+	bool bSuccess = false;
+	FlightRecord* const pfrSnapshot = (FlightRecord*)LocalAlloc(LMEM_FIXED, sizeof(pfr->pfrRecords));
+	if (0 != pfrSnapshot)
 	{
-		if (pFilter(pvAddressesInUse->at(i), pvFilterData))
-		{
-			return (int)i;
-		}
+		// Copy without stopping the packet thread, then keep only the records that
+		// were complete before the copy and weren't overwritten during it
+		const LONGLONG llRecordedBefore = InterlockedCompareExchange64(&(pfr->llRecorded), 0, 0);
+		CopyMemory(pfrSnapshot, pfr->pfrRecords, sizeof(pfr->pfrRecords));
+		const LONGLONG llRecordedAfter = InterlockedCompareExchange64(&(pfr->llRecorded), 0, 0);
+		const LONGLONG llFirst = max(max(llRecordedBefore - FLIGHT_RECORDER_SIZE, llRecordedAfter - FLIGHT_RECORDER_SIZE + 1), 0LL);
+		FlightRecorderFileHeader frfh;
+		ZeroMemory(&frfh, sizeof(frfh));
+		frfh.dwSignature = FLIGHT_RECORDER_SIGNATURE;
+		frfh.wVersion = FLIGHT_RECORDER_VERSION;
+		frfh.wRecordSize = sizeof(FlightRecord);
+		frfh.qwFirstSequence = (ULONGLONG)llFirst;
+		frfh.dwRecords = (llFirst < llRecordedBefore) ? (DWORD)(llRecordedBefore - llFirst) : 0;
+		// Oldest records are at the end of the ring (if it has wrapped)
+		const DWORD dwFirstIndex = (DWORD)(llFirst & (FLIGHT_RECORDER_SIZE - 1));
+		const DWORD dwFirstRun = min(frfh.dwRecords, FLIGHT_RECORDER_SIZE - dwFirstIndex);
+		bSuccess = WriteAll(hFile, &frfh, sizeof(frfh)) &&
+			WriteAll(hFile, pfrSnapshot + dwFirstIndex, dwFirstRun * sizeof(FlightRecord)) &&
+			WriteAll(hFile, pfrSnapshot, (frfh.dwRecords - dwFirstRun) * sizeof(FlightRecord));
+		VERIFY(0 == LocalFree(pfrSnapshot));
 	}
-	return -1;
+	return bSuccess;
 }
-bool PushBack(VectorAddressInUseInformation* const pvAddressesInUse, const AddressInUseInformation* const paiui)
+
+const char* const ppcsDHCPMessageTypeNames[] =
+{
+	"-",
+	"DISCOVER",
+	"OFFER",
+	"REQUEST",
+	"DECLINE",
+	"ACK",
+	"NAK",
+	"RELEASE",
+	"INFORM",
+};
+C_ASSERT(DHCPMessageType_INFORM + 1 == ARRAY_LENGTH(ppcsDHCPMessageTypeNames));
+
+void OutputFlightRecord(const ULONGLONG qwSequence, const FlightRecord* const pfrRecord)
 {
-	ASSERT((0 != pvAddressesInUse) && (0 != paiui));
-	try
+	ASSERT(0 != pfrRecord);
+	FILETIME ftTimestamp;
+	ftTimestamp.dwLowDateTime = (DWORD)(pfrRecord->qwTimestamp);
+	ftTimestamp.dwHighDateTime = (DWORD)(pfrRecord->qwTimestamp >> 32);
+	SYSTEMTIME stTimestamp;
+	if (!FileTimeToSystemTime(&ftTimestamp, &stTimestamp))
+	{
+		ZeroMemory(&stTimestamp, sizeof(stTimestamp));
+	}
+	char pcsChaddr[(3 * sizeof(pfrRecord->chaddr)) + 1];
+	pcsChaddr[0] = '\0';
+	const DWORD dwChaddrSize = min((DWORD)pfrRecord->hlen, (DWORD)sizeof(pfrRecord->chaddr));
+	for (DWORD i = 0; i < dwChaddrSize; i++)
 	{
-		pvAddressesInUse->push_back(*paiui);
+		sprintf_s(pcsChaddr + (3 * i), sizeof(pcsChaddr) - (3 * i), "%02x-", pfrRecord->chaddr[i]);
 	}
-	catch (const std::bad_alloc)
+	if (0 != dwChaddrSize)
 	{
-		return false;
+		pcsChaddr[(3 * dwChaddrSize) - 1] = '\0';  // Trailing separator
 	}
-	return true;
+	const DWORD dwAddr = pfrRecord->dwAddr;
+	OUTPUT((TEXT("#%llu %04d-%02d-%02d %02d:%02d:%02d.%03d xid=%08x chaddr=%s %s -> %s %d.%d.%d.%d (%u ns)"),
+		qwSequence, stTimestamp.wYear, stTimestamp.wMonth, stTimestamp.wDay, stTimestamp.wHour, stTimestamp.wMinute, stTimestamp.wSecond, stTimestamp.wMilliseconds,
+		ntohl(pfrRecord->xid), pcsChaddr,
+		(pfrRecord->bMessageType < ARRAY_LENGTH(ppcsDHCPMessageTypeNames)) ? ppcsDHCPMessageTypeNames[pfrRecord->bMessageType] : "?",
+		(pfrRecord->bDecision < FlightRecordDecision_COUNT) ? ppcsFlightRecordDecisionNames[pfrRecord->bDecision] : "?",
+		DWIP0(dwAddr), DWIP1(dwAddr), DWIP2(dwAddr), DWIP3(dwAddr), pfrRecord->dwProcessingNanoseconds));
 }
 
-// RFC 2131 section 2
-#pragma warning(push)
-#pragma warning(disable : 4200)
-#pragma pack(push, 1)
-struct DHCPMessage
+bool DecodeFlightRecorderFile(const TCHAR* const ptsFileName)
 {
-	BYTE op;
-	BYTE htype;
-	BYTE hlen;
-	BYTE hops;
-	DWORD xid;
-	WORD secs;
-	WORD flags;
-	DWORD ciaddr;
-	DWORD yiaddr;
-	DWORD siaddr;
-	DWORD giaddr;
-	BYTE chaddr[16];
-	BYTE sname[64];
-	BYTE file[128];
-	BYTE options[];
-};
-struct DHCPServerOptions
-{
-	BYTE pbMagicCookie[4];
-	BYTE pbMessageType[3];
-	BYTE pbLeaseTime[6];
-	BYTE pbSubnetMask[6];
-	BYTE pbServerID[6];
-	BYTE bEND;
-};
-#pragma pack(pop)
-#pragma warning(pop)
+	ASSERT(0 != ptsFileName);
+	bool bSuccess = false;
+	const HANDLE hFile = CreateFile(ptsFileName, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (INVALID_HANDLE_VALUE != hFile)
+	{
+		FlightRecorderFileHeader frfh;
+		DWORD dwBytesRead;
+		if (ReadFile(hFile, &frfh, sizeof(frfh), &dwBytesRead, 0) && (sizeof(frfh) == dwBytesRead) &&
+			(FLIGHT_RECORDER_SIGNATURE == frfh.dwSignature) && (FLIGHT_RECORDER_VERSION == frfh.wVersion) && (sizeof(FlightRecord) == frfh.wRecordSize))
+		{
+			OUTPUT((TEXT("%u record(s):"), frfh.dwRecords));
+			bSuccess = true;
+			for (DWORD i = 0; bSuccess && (i < frfh.dwRecords); i++)
+			{
+				FlightRecord frRecord;
+				bSuccess = (ReadFile(hFile, &frRecord, sizeof(frRecord), &dwBytesRead, 0) && (sizeof(frRecord) == dwBytesRead));
+				if (bSuccess)
+				{
+					OutputFlightRecord(frfh.qwFirstSequence + i, &frRecord);
+				}
+				else
+				{
+					OUTPUT_ERROR((TEXT("Flight recorder file is truncated.")));
+				}
+			}
+		}
+		else
+		{
+			OUTPUT_ERROR((TEXT("\"%s\" is not a flight recorder file."), ptsFileName));
+		}
+		VERIFY(CloseHandle(hFile));
+	}
+	else
+	{
+		OUTPUT_ERROR((TEXT("Unable to open \"%s\"."), ptsFileName));
+	}
+	return bSuccess;
+}
 
 bool GetIPAddressInformation(DWORD* const pdwAddr, DWORD* const pdwMask, DWORD* const pdwMinAddr, DWORD* const pdwMaxAddr)
 {
@@ -221,562 +299,1642 @@ bool GetIPAddressInformation(DWORD* const pdwAddr, DWORD* const pdwMask, DWORD*
 	return bSuccess;
 }
 
-bool InitializeDHCPServer(SOCKET* const psServerSocket, const DWORD dwServerAddr, char* const pcsServerHostName, const size_t stServerHostNameLength)
+bool ParseHexBytes(const char* const pcsHex, BYTE* const pbBytes, const DWORD dwMaxBytes, DWORD* const pdwBytes)
 {
-	ASSERT((0 != psServerSocket) && (0 != dwServerAddr) && (0 != pcsServerHostName) && (1 <= stServerHostNameLength));
-	bool bSuccess = false;
-	// Determine server hostname
-	if (0 != gethostname(pcsServerHostName, (int)stServerHostNameLength))
-	{
-		pcsServerHostName[0] = '\0';
-	}
-	// Open socket and set broadcast option on it
-	*psServerSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
-	if (INVALID_SOCKET != *psServerSocket)
+	ASSERT((0 != pcsHex) && (0 != pbBytes) && (0 != pdwBytes));
+	DWORD dwBytes = 0;
+	bool bValid = true;
+	const char* pcCurrent = pcsHex;
+	while (bValid && ('\0' != *pcCurrent))
 	{
-		SOCKADDR_IN saServerAddress;
-		saServerAddress.sin_family = AF_INET;
-		saServerAddress.sin_addr.s_addr = dwServerAddr;  // Already in network byte order
-		saServerAddress.sin_port = htons((u_short)DHCP_SERVER_PORT);
-		const int iServerAddressSize = sizeof(saServerAddress);
-		if (SOCKET_ERROR != bind(*psServerSocket, (SOCKADDR*)(&saServerAddress), iServerAddressSize))
+		if (('-' == *pcCurrent) || (':' == *pcCurrent))
 		{
-			int iBroadcastOption = TRUE;
-			if (0 == setsockopt(*psServerSocket, SOL_SOCKET, SO_BROADCAST, (char*)(&iBroadcastOption), sizeof(iBroadcastOption)))
-			{
-				bSuccess = true;
-			}
-			else
-			{
-				OUTPUT_ERROR((TEXT("Unable to set socket options.")));
-			}
+			pcCurrent++;
 		}
 		else
 		{
-			OUTPUT_ERROR((TEXT("Unable to bind to server socket (port %d)."), DHCP_SERVER_PORT));
+			unsigned int uiByte;
+			bValid = (dwBytes < dwMaxBytes) && isxdigit((BYTE)pcCurrent[0]) && isxdigit((BYTE)pcCurrent[1]) && (1 == sscanf_s(pcCurrent, "%2x", &uiByte));
+			if (bValid)
+			{
+				pbBytes[dwBytes++] = (BYTE)uiByte;
+				pcCurrent += 2;
+			}
 		}
 	}
-	else
+	*pdwBytes = dwBytes;
+	return bValid && (0 != dwBytes);
+}
+
+bool ParseAddressValue(const char* const pcsAddress, DWORD* const pdwAddrValue)
+{
+	ASSERT((0 != pcsAddress) && (0 != pdwAddrValue));
+	bool bValid = false;
+	unsigned int puiAddr[4];
+	if ((4 == sscanf_s(pcsAddress, "%u.%u.%u.%u", &puiAddr[0], &puiAddr[1], &puiAddr[2], &puiAddr[3])) &&
+		(puiAddr[0] <= 0xff) && (puiAddr[1] <= 0xff) && (puiAddr[2] <= 0xff) && (puiAddr[3] <= 0xff))
 	{
-		OUTPUT_ERROR((TEXT("Unable to open server socket (port %d)."), DHCP_SERVER_PORT));
+		*pdwAddrValue = (puiAddr[0] << 24) | (puiAddr[1] << 16) | (puiAddr[2] << 8) | puiAddr[3];
+		bValid = true;
 	}
-	return bSuccess;
+	return bValid;
 }
 
-bool FindOptionData(const BYTE bOption, const BYTE* const pbOptions, const int iOptionsSize, const BYTE** const ppbOptionData, unsigned int* const piOptionDataSize)
+// The optional configuration file narrows the range and sets the lease time,
+// assignment mode, and reservations; everything else still comes from the
+// network adapter. A reload loads a new ServerConfiguration and queues it
+// with the engine, which swaps it in between messages
+#define MAX_CONFIGURATION_VALUE_LENGTH (64)
+#define MAX_CONFIGURATION_SECTION_LENGTH (32 * 1024)
+const char pcsConfigurationSection[] = "DHCPLite";
+const char pcsReservationsSection[] = "Reservations";
+
+struct ServerConfigurationSource
 {
-	ASSERT(((0 == iOptionsSize) || (0 != pbOptions)) && (0 != ppbOptionData) && (0 != piOptionDataSize) &&
-		(option_PAD != bOption) && (option_END != bOption));
-	bool bSuccess = false;
-	// RFC 2132
-	bool bHitEND = false;
-	const BYTE* pbCurrentOption = pbOptions;
-	while (((pbCurrentOption - pbOptions) < iOptionsSize) && !bHitEND && !bSuccess)
+	char pcsFileName[MAX_PATH];  // Empty if there is no configuration file
+	AddressAssignmentModes aamDefaultMode;
+};
+
+// Missing keys keep their default; present but invalid values fail the load
+bool ReadConfigurationAddressValue(const char* const pcsFileName, const char* const pcsKey, DWORD* const pdwAddrValue)
+{
+	ASSERT((0 != pcsFileName) && (0 != pcsKey) && (0 != pdwAddrValue));
+	bool bSuccess = true;
+	char pcsValue[MAX_CONFIGURATION_VALUE_LENGTH];
+	if (0 != GetPrivateProfileString(pcsConfigurationSection, pcsKey, "", pcsValue, ARRAY_LENGTH(pcsValue), pcsFileName))
 	{
-		const BYTE bCurrentOption = *pbCurrentOption;
-		if (option_PAD == bCurrentOption)
-		{
-			pbCurrentOption++;
-		}
-		else if (option_END == bCurrentOption)
+		bSuccess = ParseAddressValue(pcsValue, pdwAddrValue);
+		if (!bSuccess)
 		{
-			bHitEND = true;
+			OUTPUT_ERROR((TEXT("Invalid %hs \"%hs\" in configuration file."), pcsKey, pcsValue));
 		}
-		else
+	}
+	return bSuccess;
+}
+
+bool ReadConfigurationReservations(ServerConfiguration* const psc, const char* const pcsFileName)
+{
+	ASSERT((0 != psc) && (0 != pcsFileName));
+	bool bSuccess = false;
+	char* const pcsSection = (char*)LocalAlloc(LMEM_FIXED, MAX_CONFIGURATION_SECTION_LENGTH);
+	if (0 != pcsSection)
+	{
+		// "<client identifier>=<address>" entries, each null-terminated, then an empty entry
+		GetPrivateProfileSection(pcsReservationsSection, pcsSection, MAX_CONFIGURATION_SECTION_LENGTH, pcsFileName);
+		bSuccess = true;
+		for (char* pcsEntry = pcsSection; bSuccess && ('\0' != *pcsEntry); pcsEntry += strlen(pcsEntry) + 1)
 		{
-			pbCurrentOption++;
-			if ((pbCurrentOption - pbOptions) < iOptionsSize)
+			char* const pcsAddress = strchr(pcsEntry, '=');
+			bSuccess = (0 != pcsAddress) && (psc->dwReservations < ARRAY_LENGTH(psc->prReservations));
+			if (bSuccess)
 			{
-				const BYTE bCurrentOptionLen = *pbCurrentOption;
-				pbCurrentOption++;
-				if (bOption == bCurrentOption)
+				*pcsAddress = '\0';
+				Reservation* const pr = &(psc->prReservations[psc->dwReservations]);
+				bSuccess = ParseHexBytes(pcsEntry, pr->pbClientIdentifier, sizeof(pr->pbClientIdentifier), &(pr->dwClientIdentifierSize)) &&
+					ParseAddressValue(pcsAddress + 1, &(pr->dwAddrValue)) &&
+					(psc->dwMinAddrValue <= pr->dwAddrValue) && (pr->dwAddrValue <= psc->dwMaxAddrValue) && (DWIPtoValue(psc->dwServerAddr) != pr->dwAddrValue);
+				for (DWORD i = 0; bSuccess && (i < psc->dwReservations); i++)
 				{
-					*ppbOptionData = pbCurrentOption;
-					*piOptionDataSize = bCurrentOptionLen;
-					bSuccess = true;
+					const Reservation* const prOther = &(psc->prReservations[i]);
+					bSuccess = (prOther->dwAddrValue != pr->dwAddrValue) &&
+						((prOther->dwClientIdentifierSize != pr->dwClientIdentifierSize) || (0 != memcmp(prOther->pbClientIdentifier, pr->pbClientIdentifier, pr->dwClientIdentifierSize)));
 				}
-				pbCurrentOption += bCurrentOptionLen;
+				*pcsAddress = '=';
+			}
+			if (bSuccess)
+			{
+				psc->dwReservations++;
 			}
 			else
 			{
-				OUTPUT_WARNING((TEXT("Invalid option data (not enough room for required length byte).")));
+				OUTPUT_ERROR((TEXT("Invalid, duplicate, or out-of-range reservation \"%hs\" in configuration file."), pcsEntry));
 			}
 		}
+		VERIFY(0 == LocalFree(pcsSection));
 	}
-	return bSuccess;
-}
-
-bool GetDHCPMessageType(const BYTE* const pbOptions, const int iOptionsSize, DHCPMessageTypes* const pdhcpmtMessageType)
-{
-	ASSERT(((0 == iOptionsSize) || (0 != pbOptions)) && (0 != pdhcpmtMessageType));
-	bool bSuccess = false;
-	const BYTE* pbDHCPMessageTypeData;
-	unsigned int iDHCPMessageTypeDataSize;
-	if (FindOptionData(option_DHCPMESSAGETYPE, pbOptions, iOptionsSize, &pbDHCPMessageTypeData, &iDHCPMessageTypeDataSize) &&
-		(1 == iDHCPMessageTypeDataSize) && (1 <= *pbDHCPMessageTypeData) && (*pbDHCPMessageTypeData <= 8))
+	else
 	{
-		*pdhcpmtMessageType = (DHCPMessageTypes)(*pbDHCPMessageTypeData);
-		bSuccess = true;
+		OUTPUT_ERROR((TEXT("Insufficient memory for configuration file reservations.")));
 	}
 	return bSuccess;
 }
 
-bool AddressInUseInformationAddrValueFilter(const AddressInUseInformation& raiui, const void* const pvFilterData)
-{
-	const DWORD* const pdwAddrValue = (DWORD*)pvFilterData;
-	return (*pdwAddrValue == raiui.dwAddrValue);
-}
-
-struct ClientIdentifierData
-{
-	const BYTE* pbClientIdentifier;
-	DWORD dwClientIdentifierSize;
-};
-bool AddressInUseInformationClientIdentifierFilter(const AddressInUseInformation& raiui, const void* const pvFilterData)
-{
-	const ClientIdentifierData* const pcid = (ClientIdentifierData*)pvFilterData;
-	ASSERT(0 != pcid);
-	return ((0 != raiui.dwClientIdentifierSize) && (pcid->dwClientIdentifierSize == raiui.dwClientIdentifierSize) && (0 == memcmp(pcid->pbClientIdentifier, raiui.pbClientIdentifier, pcid->dwClientIdentifierSize)));
-}
-
-void ProcessDHCPClientRequest(const SOCKET sServerSocket, const char* const pcsServerHostName, const BYTE* const pbData, const int iDataSize, VectorAddressInUseInformation* const pvAddressesInUse, const DWORD dwServerAddr, const DWORD dwMask, const DWORD dwMinAddr, const DWORD dwMaxAddr)
+bool ReadConfigurationFile(ServerConfiguration* const psc, const char* const pcsFileName)
 {
-	ASSERT((INVALID_SOCKET != sServerSocket) && (0 != pcsServerHostName) && ((0 == iDataSize) || (0 != pbData)) && (0 != pvAddressesInUse) && (0 != dwServerAddr) && (0 != dwMask) && (0 != dwMinAddr) && (0 != dwMaxAddr));
-	const DHCPMessage* const pdhcpmRequest = (DHCPMessage*)pbData;
-	if ((((sizeof(*pdhcpmRequest) + sizeof(pbDHCPMagicCookie)) <= iDataSize) &&  // Take into account mandatory DHCP magic cookie values in options array (RFC 2131 section 3)
-		(op_BOOTREQUEST == pdhcpmRequest->op) &&
-		// (pdhcpmRequest->htype) && // Could also validate htype
-		(0 == memcmp(pbDHCPMagicCookie, pdhcpmRequest->options, sizeof(pbDHCPMagicCookie))))
-		)
-	{
-		const BYTE* const pbOptions = pdhcpmRequest->options + sizeof(pbDHCPMagicCookie);
-		const int iOptionsSize = iDataSize - (int)sizeof(*pdhcpmRequest) - (int)sizeof(pbDHCPMagicCookie);
-		DHCPMessageTypes dhcpmtMessageType;
-		if (GetDHCPMessageType(pbOptions, iOptionsSize, &dhcpmtMessageType))
-		{
-			// Determine client host name
-			char pcsClientHostName[MAX_HOSTNAME_LENGTH];
-			pcsClientHostName[0] = '\0';
-			const BYTE* pbRequestHostNameData;
-			unsigned int iRequestHostNameDataSize;
-			if (FindOptionData(option_HOSTNAME, pbOptions, iOptionsSize, &pbRequestHostNameData, &iRequestHostNameDataSize))
-			{
-				const size_t stHostNameCopySize = min(iRequestHostNameDataSize + 1, ARRAY_LENGTH(pcsClientHostName));
-				_tcsncpy_s(pcsClientHostName, stHostNameCopySize, (char*)pbRequestHostNameData, _TRUNCATE);
-			}
-			if (('\0' == pcsServerHostName[0]) || (0 != _stricmp(pcsClientHostName, pcsServerHostName)))
-			{
-				// Determine client identifier in proper RFC 2131 order (client identifier option then chaddr)
-				const BYTE* pbRequestClientIdentifierData;
-				unsigned int iRequestClientIdentifierDataSize;
-				if (!FindOptionData(option_CLIENTIDENTIFIER, pbOptions, iOptionsSize, &pbRequestClientIdentifierData, &iRequestClientIdentifierDataSize))
-				{
-					pbRequestClientIdentifierData = pdhcpmRequest->chaddr;
-					iRequestClientIdentifierDataSize = sizeof(pdhcpmRequest->chaddr);
-				}
-				// Determine if we've seen this client before
-				bool bSeenClientBefore = false;
-				DWORD dwClientPreviousOfferAddr = (DWORD)INADDR_BROADCAST;  // Invalid IP address for later comparison
-				const ClientIdentifierData cid = { pbRequestClientIdentifierData, (DWORD)iRequestClientIdentifierDataSize };
-				const int iIndex = FindIndexOf(pvAddressesInUse, AddressInUseInformationClientIdentifierFilter, &cid);
-				if (-1 != iIndex)
-				{
-					const AddressInUseInformation aiui = pvAddressesInUse->at((size_t)iIndex);
-					dwClientPreviousOfferAddr = DWValuetoIP(aiui.dwAddrValue);
-					bSeenClientBefore = true;
-				}
-				// Server message handling
-				// RFC 2131 section 4.3
-				BYTE bDHCPMessageBuffer[sizeof(DHCPMessage) + sizeof(DHCPServerOptions)];
-				ZeroMemory(bDHCPMessageBuffer, sizeof(bDHCPMessageBuffer));
-				DHCPMessage* const pdhcpmReply = (DHCPMessage*)&bDHCPMessageBuffer;
-				pdhcpmReply->op = op_BOOTREPLY;
-				pdhcpmReply->htype = pdhcpmRequest->htype;
-				pdhcpmReply->hlen = pdhcpmRequest->hlen;
-				// pdhcpmReply->hops = 0;
-				pdhcpmReply->xid = pdhcpmRequest->xid;
-				// pdhcpmReply->ciaddr = 0;
-				// pdhcpmReply->yiaddr = 0;  Or changed below
-				// pdhcpmReply->siaddr = 0;
-				pdhcpmReply->flags = pdhcpmRequest->flags;
-				pdhcpmReply->giaddr = pdhcpmRequest->giaddr;
-				CopyMemory(pdhcpmReply->chaddr, pdhcpmRequest->chaddr, sizeof(pdhcpmReply->chaddr));
-				strncpy_s((char*)(pdhcpmReply->sname), sizeof(pdhcpmReply->sname), pcsServerName, _TRUNCATE);
-				// pdhcpmReply->file = 0;
-				// pdhcpmReply->options below
-				DHCPServerOptions* const pdhcpsoServerOptions = (DHCPServerOptions*)(pdhcpmReply->options);
-				CopyMemory(pdhcpsoServerOptions->pbMagicCookie, pbDHCPMagicCookie, sizeof(pdhcpsoServerOptions->pbMagicCookie));
-				// DHCP Message Type - RFC 2132 section 9.6
-				pdhcpsoServerOptions->pbMessageType[0] = option_DHCPMESSAGETYPE;
-				pdhcpsoServerOptions->pbMessageType[1] = 1;
-				// pdhcpsoServerOptions->pbMessageType[2] set below
-				// IP Address Lease Time - RFC 2132 section 9.2
-				pdhcpsoServerOptions->pbLeaseTime[0] = option_IPADDRESSLEASETIME;
-				pdhcpsoServerOptions->pbLeaseTime[1] = 4;
-				C_ASSERT(sizeof(u_long) == 4);
-				*((u_long*)(&(pdhcpsoServerOptions->pbLeaseTime[2]))) = htonl(1 * 60 * 60);  // One hour
-				// Subnet Mask - RFC 2132 section 3.3
-				pdhcpsoServerOptions->pbSubnetMask[0] = option_SUBNETMASK;
-				pdhcpsoServerOptions->pbSubnetMask[1] = 4;
-				C_ASSERT(sizeof(u_long) == 4);
-				*((u_long*)(&(pdhcpsoServerOptions->pbSubnetMask[2]))) = dwMask;  // Already in network order
-				// Server Identifier - RFC 2132 section 9.7
-				pdhcpsoServerOptions->pbServerID[0] = option_SERVERIDENTIFIER;
-				pdhcpsoServerOptions->pbServerID[1] = 4;
-				C_ASSERT(sizeof(u_long) == 4);
-				*((u_long*)(&(pdhcpsoServerOptions->pbServerID[2]))) = dwServerAddr;  // Already in network order
-				pdhcpsoServerOptions->bEND = option_END;
-				bool bSendDHCPMessage = false;
-				switch (dhcpmtMessageType)
-				{
-				case DHCPMessageType_DISCOVER:
-				{
-					// RFC 2131 section 4.3.1
-					// UNSUPPORTED: Requested IP Address option
-					static DWORD dwServerLastOfferAddrValue = DWIPtoValue(dwMaxAddr);  // Initialize to max to wrap and offer min first
-					const DWORD dwMinAddrValue = DWIPtoValue(dwMinAddr);
-					const DWORD dwMaxAddrValue = DWIPtoValue(dwMaxAddr);
-					DWORD dwOfferAddrValue;
-					bool bOfferAddrValueValid = false;
-					if (bSeenClientBefore)
-					{
-						dwOfferAddrValue = DWIPtoValue(dwClientPreviousOfferAddr);
-						bOfferAddrValueValid = true;
-					}
-					else
-					{
-						dwOfferAddrValue = dwServerLastOfferAddrValue + 1;
-					}
-					// Search for an available address if necessary
-					const DWORD dwInitialOfferAddrValue = dwOfferAddrValue;
-					bool bOfferedInitialValue = false;
-					while (!bOfferAddrValueValid && !(bOfferedInitialValue && (dwInitialOfferAddrValue == dwOfferAddrValue)))  // Detect address exhaustion
-					{
-						if (dwMaxAddrValue < dwOfferAddrValue)
-						{
-							ASSERT(dwMaxAddrValue + 1 == dwOfferAddrValue);
-							dwOfferAddrValue = dwMinAddrValue;
-						}
-						bOfferAddrValueValid = (-1 == FindIndexOf(pvAddressesInUse, AddressInUseInformationAddrValueFilter, &dwOfferAddrValue));
-						bOfferedInitialValue = true;
-						if (!bOfferAddrValueValid)
-						{
-							dwOfferAddrValue++;
-						}
-					}
-					if (bOfferAddrValueValid)
-					{
-						dwServerLastOfferAddrValue = dwOfferAddrValue;
-						const DWORD dwOfferAddr = DWValuetoIP(dwOfferAddrValue);
-						ASSERT((0 != iRequestClientIdentifierDataSize) && (0 != pbRequestClientIdentifierData));
-						AddressInUseInformation aiuiClientAddress;
-						aiuiClientAddress.dwAddrValue = dwOfferAddrValue;
-						aiuiClientAddress.pbClientIdentifier = (BYTE*)LocalAlloc(LMEM_FIXED, iRequestClientIdentifierDataSize);
-						if (0 != aiuiClientAddress.pbClientIdentifier)
-						{
-							CopyMemory(aiuiClientAddress.pbClientIdentifier, pbRequestClientIdentifierData, iRequestClientIdentifierDataSize);
-							aiuiClientAddress.dwClientIdentifierSize = iRequestClientIdentifierDataSize;
-							if (bSeenClientBefore || PushBack(pvAddressesInUse, &aiuiClientAddress))
-							{
-								pdhcpmReply->yiaddr = dwOfferAddr;
-								pdhcpsoServerOptions->pbMessageType[2] = DHCPMessageType_OFFER;
-								bSendDHCPMessage = true;
-								OUTPUT((TEXT("Offering client \"%hs\" IP address %d.%d.%d.%d"), pcsClientHostName, DWIP0(dwOfferAddr), DWIP1(dwOfferAddr), DWIP2(dwOfferAddr), DWIP3(dwOfferAddr)));
-							}
-							else
-							{
-								VERIFY(0 == LocalFree(aiuiClientAddress.pbClientIdentifier));
-								OUTPUT_ERROR((TEXT("Insufficient memory to add client address.")));
-							}
-							if (bSeenClientBefore)
-							{
-								VERIFY(0 == LocalFree(aiuiClientAddress.pbClientIdentifier));
-							}
-						}
-						else
-						{
-							OUTPUT_ERROR((TEXT("Insufficient memory to add client address.")));
-						}
-					}
-					else
-					{
-						OUTPUT_ERROR((TEXT("No more IP addresses available for client \"%hs\""), pcsClientHostName));
-					}
-				}
-				break;
-				case DHCPMessageType_REQUEST:
+	ASSERT((0 != psc) && (0 != pcsFileName));
+	bool bSuccess = false;
+	DWORD dwMinAddrValue = psc->dwMinAddrValue;
+	DWORD dwMaxAddrValue = psc->dwMaxAddrValue;
+	if (ReadConfigurationAddressValue(pcsFileName, "FirstAddress", &dwMinAddrValue) && ReadConfigurationAddressValue(pcsFileName, "LastAddress", &dwMaxAddrValue))
+	{
+		// The range must be within the server's subnet
+		const DWORD dwMaskValue = DWIPtoValue(psc->dwMask);
+		const DWORD dwSubnetValue = DWIPtoValue(psc->dwServerAddr) & dwMaskValue;
+		if ((dwMinAddrValue <= dwMaxAddrValue) && (dwMaxAddrValue - dwMinAddrValue < MAX_LEASE_TABLE_SIZE) &&
+			(dwSubnetValue == (dwMinAddrValue & dwMaskValue)) && (dwSubnetValue == (dwMaxAddrValue & dwMaskValue)))
+		{
+			psc->dwMinAddrValue = dwMinAddrValue;
+			psc->dwMaxAddrValue = dwMaxAddrValue;
+			psc->dwLeaseTime = GetPrivateProfileInt(pcsConfigurationSection, "LeaseTime", psc->dwLeaseTime, pcsFileName);
+			psc->dwRenewalJitter = GetPrivateProfileInt(pcsConfigurationSection, "RenewalJitter", psc->dwRenewalJitter, pcsFileName);
+			psc->dwOfferHoldTime = GetPrivateProfileInt(pcsConfigurationSection, "OfferHoldTime", psc->dwOfferHoldTime, pcsFileName);
+			if ((MIN_LEASE_TIME <= psc->dwLeaseTime) && (0x7fffffff >= psc->dwLeaseTime) && (psc->dwRenewalJitter <= MAX_RENEWAL_JITTER) &&
+				(0 < psc->dwOfferHoldTime) && (psc->dwOfferHoldTime <= MAX_OFFER_HOLD_TIME))
+			{
+				char pcsMode[MAX_CONFIGURATION_VALUE_LENGTH];
+				GetPrivateProfileString(pcsConfigurationSection, "AssignmentMode", "", pcsMode, ARRAY_LENGTH(pcsMode), pcsFileName);
+				if (('\0' == pcsMode[0]) || (0 == _stricmp(pcsMode, "nextfit")) || (0 == _stricmp(pcsMode, "hash")))
 				{
-					// RFC 2131 section 4.3.2
-					// Determine requested IP address
-					DWORD dwRequestedIPAddress = INADDR_BROADCAST;  // Invalid IP address for later comparison
-					const BYTE* pbRequestRequestedIPAddressData = 0;
-					unsigned int iRequestRequestedIPAddressDataSize = 0;
-					if (FindOptionData(option_REQUESTEDIPADDRESS, pbOptions, iOptionsSize, &pbRequestRequestedIPAddressData, &iRequestRequestedIPAddressDataSize) && (sizeof(dwRequestedIPAddress) == iRequestRequestedIPAddressDataSize))
-					{
-						dwRequestedIPAddress = *((DWORD*)pbRequestRequestedIPAddressData);
-					}
-					// Determine server identifier
-					const BYTE* pbRequestServerIdentifierData = 0;
-					unsigned int iRequestServerIdentifierDataSize = 0;
-					if (FindOptionData(option_SERVERIDENTIFIER, pbOptions, iOptionsSize, &pbRequestServerIdentifierData, &iRequestServerIdentifierDataSize) &&
-						(sizeof(dwServerAddr) == iRequestServerIdentifierDataSize) && (dwServerAddr == *((DWORD*)pbRequestServerIdentifierData)))
-					{
-						// Response to OFFER
-						// DHCPREQUEST generated during SELECTING state
-						ASSERT(0 == pdhcpmRequest->ciaddr);
-						if (bSeenClientBefore)
-						{
-							// Already have an IP address for this client - ACK it
-							pdhcpsoServerOptions->pbMessageType[2] = DHCPMessageType_ACK;
-							// Will set other options below
-						}
-						else
-						{
-							// Haven't seen this client before - NAK it
-							pdhcpsoServerOptions->pbMessageType[2] = DHCPMessageType_NAK;
-							// Will clear invalid options and prepare to send message below
-						}
-					}
-					else
-					{
-						// Request to verify or extend
-						if (((INADDR_BROADCAST != dwRequestedIPAddress) /*&& (0 == pdhcpmRequest->ciaddr)*/) ||  // DHCPREQUEST generated during INIT-REBOOT state - Some clients set ciaddr in this case, so deviate from the spec by allowing it
-							((INADDR_BROADCAST == dwRequestedIPAddress) && (0 != pdhcpmRequest->ciaddr)))  // Unicast -> DHCPREQUEST generated during RENEWING state / Broadcast -> DHCPREQUEST generated during REBINDING state
-						{
-							if (bSeenClientBefore && ((dwClientPreviousOfferAddr == dwRequestedIPAddress) || (dwClientPreviousOfferAddr == pdhcpmRequest->ciaddr)))
-							{
-								// Already have an IP address for this client - ACK it
-								pdhcpsoServerOptions->pbMessageType[2] = DHCPMessageType_ACK;
-								// Will set other options below
-							}
-							else
-							{
-								// Haven't seen this client before or requested IP address is invalid
-								pdhcpsoServerOptions->pbMessageType[2] = DHCPMessageType_NAK;
-								// Will clear invalid options and prepare to send message below
-							}
-						}
-						else
-						{
-							OUTPUT_WARNING((TEXT("Invalid DHCP message (invalid data).")));
-						}
-					}
-					switch (pdhcpsoServerOptions->pbMessageType[2])
+					if ('\0' != pcsMode[0])
 					{
-					case DHCPMessageType_ACK:
-						ASSERT(INADDR_BROADCAST != dwClientPreviousOfferAddr);
-						pdhcpmReply->ciaddr = dwClientPreviousOfferAddr;
-						pdhcpmReply->yiaddr = dwClientPreviousOfferAddr;
-						bSendDHCPMessage = true;
-						OUTPUT((TEXT("Acknowledging client \"%hs\" has IP address %d.%d.%d.%d"), pcsClientHostName, DWIP0(dwClientPreviousOfferAddr), DWIP1(dwClientPreviousOfferAddr), DWIP2(dwClientPreviousOfferAddr), DWIP3(dwClientPreviousOfferAddr)));
-						break;
-					case DHCPMessageType_NAK:
-						C_ASSERT(0 == option_PAD);
-						ZeroMemory(pdhcpsoServerOptions->pbLeaseTime, sizeof(pdhcpsoServerOptions->pbLeaseTime));
-						ZeroMemory(pdhcpsoServerOptions->pbSubnetMask, sizeof(pdhcpsoServerOptions->pbSubnetMask));
-						bSendDHCPMessage = true;
-						OUTPUT((TEXT("Denying client \"%hs\" unoffered IP address."), pcsClientHostName));
-						break;
-					default:
-						// Nothing to do
-						break;
+						psc->aamMode = (0 == _stricmp(pcsMode, "hash")) ? AddressAssignmentMode_HASH : AddressAssignmentMode_NEXTFIT;
 					}
+					bSuccess = ReadConfigurationReservations(psc, pcsFileName);
 				}
-				break;
-				case DHCPMessageType_DECLINE:
-					// Fall-through
-				case DHCPMessageType_RELEASE:
-					// UNSUPPORTED: Mark address as unused
-					break;
-				case DHCPMessageType_INFORM:
-					// Unsupported DHCP message type - fail silently
-					break;
-				case DHCPMessageType_OFFER:
-				case DHCPMessageType_ACK:
-				case DHCPMessageType_NAK:
-					OUTPUT_WARNING((TEXT("Unexpected DHCP message type.")));
-					break;
-				default:
-					ASSERT(!"Invalid DHCPMessageType");
-					break;
-				}
-				if (bSendDHCPMessage)
+				else
 				{
-					ASSERT(0 != pdhcpsoServerOptions->pbMessageType[2]);  // Must have set an option if we're going to be sending this message
-					// Determine how to send the reply
-					// RFC 2131 section 4.1
-					u_long ulAddr = INADDR_LOOPBACK;  // Invalid value
-					if (0 == pdhcpmRequest->giaddr)
-					{
-						switch (pdhcpsoServerOptions->pbMessageType[2])
-						{
-						case DHCPMessageType_OFFER:
-							// Fall-through
-						case DHCPMessageType_ACK:
-						{
-							if (0 == pdhcpmRequest->ciaddr)
-							{
-								if (0 != (BROADCAST_FLAG & pdhcpmRequest->flags))
-								{
-									ulAddr = INADDR_BROADCAST;
-								}
-								else
-								{
-									ulAddr = pdhcpmRequest->yiaddr;  // Already in network order
-									if (0 == ulAddr)
-									{
-										// UNSUPPORTED: Unicast to hardware address
-										// Instead, broadcast the response and rely on other DHCP clients to ignore it
-										ulAddr = INADDR_BROADCAST;
-									}
-								}
-							}
-							else
-							{
-								ulAddr = pdhcpmRequest->ciaddr;  // Already in network order
-							}
-						}
-						break;
-						case DHCPMessageType_NAK:
-						{
-							ulAddr = INADDR_BROADCAST;
-						}
-						break;
-						default:
-							ASSERT(!"Invalid DHCPMessageType");
-							break;
-						}
-					}
-					else
-					{
-						ulAddr = pdhcpmRequest->giaddr;  // Already in network order
-						pdhcpmReply->flags |= BROADCAST_FLAG;  // Indicate to the relay agent that it must broadcast
-					}
-					ASSERT((INADDR_LOOPBACK != ulAddr) && (0 != ulAddr));
-					SOCKADDR_IN saClientAddress;
-					saClientAddress.sin_family = AF_INET;
-					saClientAddress.sin_addr.s_addr = ulAddr;
-					saClientAddress.sin_port = htons((u_short)DHCP_CLIENT_PORT);
-					VERIFY(SOCKET_ERROR != sendto(sServerSocket, (char*)pdhcpmReply, sizeof(bDHCPMessageBuffer), 0, (SOCKADDR*)&saClientAddress, sizeof(saClientAddress)));
+					OUTPUT_ERROR((TEXT("Invalid AssignmentMode \"%hs\" in configuration file (expected nextfit or hash)."), pcsMode));
 				}
 			}
 			else
 			{
-				// Ignore attempts by the DHCP server to obtain a DHCP address (possible if its current address was obtained by auto-IP) because this would invalidate dwServerAddr
+				OUTPUT_ERROR((TEXT("Invalid LeaseTime, RenewalJitter, or OfferHoldTime in configuration file.")));
+				OUTPUT_ERROR((TEXT("[Lease time must be at least %d seconds, jitter at most %d percent, and offer hold time 1 to %d seconds.]"), MIN_LEASE_TIME, MAX_RENEWAL_JITTER, MAX_OFFER_HOLD_TIME));
 			}
 		}
 		else
 		{
-			OUTPUT_WARNING((TEXT("Invalid DHCP message (invalid or missing DHCP message type).")));
+			OUTPUT_ERROR((TEXT("Invalid address range in configuration file.")));
+			OUTPUT_ERROR((TEXT("[The range must be within the server's subnet and have at most %d addresses.]"), MAX_LEASE_TABLE_SIZE));
 		}
 	}
 	else
 	{
-		OUTPUT_WARNING((TEXT("Invalid DHCP message (failed initial checks).")));
+		// OUTPUT_ERROR called by ReadConfigurationAddressValue
 	}
+	return bSuccess;
 }
 
-bool ReadDHCPClientRequests(const SOCKET sServerSocket, const char* const pcsServerHostName, VectorAddressInUseInformation* const pvAddressesInUse, const DWORD dwServerAddr, const DWORD dwMask, const DWORD dwMinAddr, const DWORD dwMaxAddr)
+bool LoadServerConfiguration(ServerConfiguration* const psc, const ServerConfigurationSource* const pscs)
 {
-	ASSERT((INVALID_SOCKET != sServerSocket) && (0 != pcsServerHostName) && (0 != pvAddressesInUse) && (0 != dwServerAddr) && (0 != dwMask) && (0 != dwMinAddr) && (0 != dwMaxAddr));
+	ASSERT((0 != psc) && (0 != pscs));
 	bool bSuccess = false;
-	BYTE* const pbReadBuffer = (BYTE*)LocalAlloc(LMEM_FIXED, MAX_UDP_MESSAGE_SIZE);
-	if (0 != pbReadBuffer)
+	ZeroMemory(psc, sizeof(*psc));
+	DWORD dwMinAddr;
+	DWORD dwMaxAddr;
+	if (GetIPAddressInformation(&(psc->dwServerAddr), &(psc->dwMask), &dwMinAddr, &dwMaxAddr))
 	{
-		bSuccess = true;
-		int iLastError = 0;
-		ASSERT(WSAENOTSOCK != iLastError);
-		while (WSAENOTSOCK != iLastError)
+		psc->dwMinAddrValue = DWIPtoValue(dwMinAddr);
+		psc->dwMaxAddrValue = min(DWIPtoValue(dwMaxAddr), psc->dwMinAddrValue + (MAX_LEASE_TABLE_SIZE - 1));  // Serve the start of very large subnets
+		psc->dwLeaseTime = DEFAULT_LEASE_TIME;
+		psc->dwRenewalJitter = DEFAULT_RENEWAL_JITTER;
+		psc->dwOfferHoldTime = DEFAULT_OFFER_HOLD_TIME;
+		psc->aamMode = pscs->aamDefaultMode;
+		if ('\0' == pscs->pcsFileName[0])
 		{
-			SOCKADDR_IN saClientAddress;
-			int iClientAddressSize = sizeof(saClientAddress);
-			const int iBytesReceived = recvfrom(sServerSocket, (char*)pbReadBuffer, MAX_UDP_MESSAGE_SIZE, 0, (SOCKADDR*)(&saClientAddress), &iClientAddressSize);
-			if (SOCKET_ERROR != iBytesReceived)
-			{
-				// ASSERT(DHCP_CLIENT_PORT == ntohs(saClientAddress.sin_port));  // Not always the case
-				ProcessDHCPClientRequest(sServerSocket, pcsServerHostName, pbReadBuffer, iBytesReceived, pvAddressesInUse, dwServerAddr, dwMask, dwMinAddr, dwMaxAddr);
-			}
-			else
+			bSuccess = true;
+		}
+		else if (INVALID_FILE_ATTRIBUTES != GetFileAttributes(pscs->pcsFileName))
+		{
+			bSuccess = ReadConfigurationFile(psc, pscs->pcsFileName);
+		}
+		else
+		{
+			OUTPUT_ERROR((TEXT("Unable to open configuration file \"%hs\"."), pscs->pcsFileName));
+		}
+		if (bSuccess)
+		{
+			const DWORD dwFirstAddr = DWValuetoIP(psc->dwMinAddrValue);
+			const DWORD dwLastAddr = DWValuetoIP(psc->dwMaxAddrValue);
+			OUTPUT((TEXT("Serving:[%d.%d.%d.%d-%d.%d.%d.%d] - Reservations:%u"),
+				DWIP0(dwFirstAddr), DWIP1(dwFirstAddr), DWIP2(dwFirstAddr), DWIP3(dwFirstAddr),
+				DWIP0(dwLastAddr), DWIP1(dwLastAddr), DWIP2(dwLastAddr), DWIP3(dwLastAddr),
+				psc->dwReservations));
+			OUTPUT((TEXT("Lease time:%u seconds - Renewal jitter:%u%% - Offer hold time:%u seconds"), psc->dwLeaseTime, psc->dwRenewalJitter, psc->dwOfferHoldTime));
+			if (AddressAssignmentMode_HASH == psc->aamMode)
 			{
-				iLastError = WSAGetLastError();
-				if (WSAENOTSOCK == iLastError)
-				{
-					OUTPUT((TEXT("Stopping server request handler.")));
-				}
-				else if (WSAEINTR == iLastError)
-				{
-					OUTPUT((TEXT("Socket operation was cancelled.")));
-				}
-				else
-				{
-					OUTPUT_ERROR((TEXT("Call to recvfrom returned error %d."), iLastError));
-				}
+				OUTPUT((TEXT("Addresses are assigned by hash of client identifier.")));
 			}
 		}
-		VERIFY(0 == LocalFree(pbReadBuffer));
 	}
 	else
 	{
-		OUTPUT_ERROR((TEXT("Unable to allocate memory for client datagram read buffer.")));
+		// OUTPUT_ERROR called by GetIPAddressInformation
 	}
 	return bSuccess;
 }
 
-SOCKET sServerSocket = INVALID_SOCKET;  // Global to allow ConsoleCtrlHandlerRoutine access to it
-
-BOOL WINAPI ConsoleCtrlHandlerRoutine(DWORD dwCtrlType)
+bool InitializeDHCPServer(SOCKET* const psServerSocket, const DWORD dwServerAddr, char* const pcsServerHostName, const size_t stServerHostNameLength)
 {
-	BOOL bReturn = FALSE;
-	if ((CTRL_C_EVENT == dwCtrlType) || (CTRL_BREAK_EVENT == dwCtrlType))
+	ASSERT((0 != psServerSocket) && (0 != dwServerAddr) && (0 != pcsServerHostName) && (1 <= stServerHostNameLength));
+	bool bSuccess = false;
+	// Determine server hostname
+	if (0 != gethostname(pcsServerHostName, (int)stServerHostNameLength))
 	{
-		if (INVALID_SOCKET != sServerSocket)
-		{
-			VERIFY(0 == closesocket(sServerSocket));
-			sServerSocket = INVALID_SOCKET;
-		}
-		bReturn = TRUE;
+		pcsServerHostName[0] = '\0';
 	}
-	return bReturn;
-}
-
-int main(int /*argc*/, char** /*argv*/)
-{
-	OUTPUT((TEXT("")));
-	OUTPUT((TEXT("DHCPLite")));
-	OUTPUT((TEXT("2016-04-02")));
-	OUTPUT((TEXT("Copyright (c) 2001-2016 by David Anson (http://dlaa.me/)")));
-	OUTPUT((TEXT("")));
-	if (SetConsoleCtrlHandler(ConsoleCtrlHandlerRoutine, TRUE))
-	{
-		DWORD dwServerAddr;
-		DWORD dwMask;
-		DWORD dwMinAddr;
-		DWORD dwMaxAddr;
-		if (GetIPAddressInformation(&dwServerAddr, &dwMask, &dwMinAddr, &dwMaxAddr))
-		{
-			ASSERT((DWValuetoIP(dwMinAddr) <= DWValuetoIP(dwServerAddr)) && (DWValuetoIP(dwServerAddr) <= DWValuetoIP(dwMaxAddr)));
-			VectorAddressInUseInformation vAddressesInUse;
-			AddressInUseInformation aiuiServerAddress;
-			aiuiServerAddress.dwAddrValue = DWIPtoValue(dwServerAddr);
-			aiuiServerAddress.pbClientIdentifier = 0;  // Server entry is only entry without a client ID
-			aiuiServerAddress.dwClientIdentifierSize = 0;
-			if (PushBack(&vAddressesInUse, &aiuiServerAddress))
-			{
-				WSADATA wsaData;
+	// Open socket and set broadcast option on it
+	*psServerSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+	if (INVALID_SOCKET != *psServerSocket)
+	{
+		SOCKADDR_IN saServerAddress;
+		saServerAddress.sin_family = AF_INET;
+		saServerAddress.sin_addr.s_addr = dwServerAddr;  // Already in network byte order
+		saServerAddress.sin_port = htons((u_short)DHCP_SERVER_PORT);
+		const int iServerAddressSize = sizeof(saServerAddress);
+		if (SOCKET_ERROR != bind(*psServerSocket, (SOCKADDR*)(&saServerAddress), iServerAddressSize))
+		{
+			int iBroadcastOption = TRUE;
+			if (0 == setsockopt(*psServerSocket, SOL_SOCKET, SO_BROADCAST, (char*)(&iBroadcastOption), sizeof(iBroadcastOption)))
+			{
+				bSuccess = true;
+			}
+			else
+			{
+				OUTPUT_ERROR((TEXT("Unable to set socket options.")));
+			}
+		}
+		else
+		{
+			OUTPUT_ERROR((TEXT("Unable to bind to server socket (port %d)."), DHCP_SERVER_PORT));
+		}
+	}
+	else
+	{
+		OUTPUT_ERROR((TEXT("Unable to open server socket (port %d)."), DHCP_SERVER_PORT));
+	}
+	return bSuccess;
+}
+
+
+// Client host names are published in DNS (RFC 2136) by their own thread: the
+// packet thread only queues changes, which are coalesced and sent in batches
+// (one UPDATE per zone) and retried with backoff, so DHCP never waits on DNS
+#define DNS_SERVER_PORT (53)
+#define MAX_DNS_NAME_LENGTH (253)  // Without the trailing dot (RFC 1035 section 2.3.4)
+#define MAX_DNS_LABEL_LENGTH (63)
+#define MAX_DNS_UDP_MESSAGE_SIZE (512)  // RFC 1035 section 4.2.1
+#define DNS_HEADER_SIZE (12)
+#define MAX_DYNAMIC_DNS_PENDING_CHANGES (4096)  // Power of two (ring buffer)
+C_ASSERT(0 == (MAX_DYNAMIC_DNS_PENDING_CHANGES & (MAX_DYNAMIC_DNS_PENDING_CHANGES - 1)));
+#define DYNAMIC_DNS_CHANGE_HASH_BUCKETS (MAX_DYNAMIC_DNS_PENDING_CHANGES)
+// Changes claimed per batch; a batch ends sooner when either message reaches MAX_DNS_UDP_MESSAGE_SIZE
+// (about 7 adds with 15-character host names and a reverse zone, at most 15 with 1-character names)
+#define MAX_DYNAMIC_DNS_BATCH_CHANGES (16)
+#define DYNAMIC_DNS_BATCH_DELAY_MILLISECONDS (250)  // Changes that arrive together are sent together
+#define DYNAMIC_DNS_RESPONSE_TIMEOUT_SECONDS (2)
+#define DYNAMIC_DNS_FIRST_RETRY_MILLISECONDS (1000)  // Doubled after each attempt
+#define DYNAMIC_DNS_MAX_RETRY_MILLISECONDS (60 * 1000)
+#define MAX_DYNAMIC_DNS_ATTEMPTS (8)
+// Keeps any single change within one UPDATE message
+#define MAX_DYNAMIC_DNS_ZONE_NAMES_LENGTH (256)  // Forward and reverse zones together
+// RFC 1035 section 3.2.2 and RFC 2136 section 1.3
+enum dns_values
+{
+	dns_TYPE_A = 1,
+	dns_TYPE_SOA = 6,
+	dns_TYPE_PTR = 12,
+	dns_CLASS_IN = 1,
+	dns_CLASS_NONE = 254,
+	dns_CLASS_ANY = 255,
+	dns_OPCODE_UPDATE = 5,
+	dns_RCODE_NOERROR = 0,
+	dns_RCODE_SERVFAIL = 2,
+};
+
+struct DynamicDNSConfiguration
+{
+	DWORD dwServerAddr;  // Network order (0 if dynamic DNS is off)
+	WORD wServerPort;  // Network order
+	char pcsForwardZone[MAX_DNS_NAME_LENGTH + 1];
+	char pcsReverseZone[MAX_DNS_NAME_LENGTH + 1];  // Empty if PTR records are not updated
+};
+
+struct DynamicDNSChange
+{
+	DWORD dwAddr;  // Network order
+	char pcsHostName[MAX_DNS_LABEL_LENGTH + 1];
+	DWORD dwTTL;  // Seconds (adds); the lease time when the change was queued, so a reload applies to later changes
+	bool bAdd;  // Otherwise remove
+	bool bSuperseded;  // A newer change for the same name and address was queued after it
+};
+
+struct DNSUpdateMessage
+{
+	BYTE pbMessage[MAX_DNS_UDP_MESSAGE_SIZE];
+	int iSize;  // 0 once sent successfully (or if there is nothing to send)
+	WORD wUpdates;
+};
+
+// One batch of changes; it is retried until both messages are sent
+struct DynamicDNSBatch
+{
+	DWORD dwChanges;  // 0 if there is no batch
+	DNSUpdateMessage dumForward;
+	DNSUpdateMessage dumReverse;
+};
+
+struct DynamicDNSUpdater
+{
+	DynamicDNSConfiguration ddcConfiguration;
+	// Held only to append or claim changes (never while a message is built or sent), so the packet thread does O(1) work under it
+	CRITICAL_SECTION csPending;
+	// Ring of MAX_DYNAMIC_DNS_PENDING_CHANGES indexed by sequence number; [dwOldestChange, dwFirstPendingChange) is
+	// claimed by the updater thread (which reads it without the lock) and [dwFirstPendingChange, dwNextChange) is pending
+	DynamicDNSChange* pddcPending;
+	DWORD dwOldestChange;
+	DWORD dwFirstPendingChange;
+	DWORD dwNextChange;
+	DWORD* pdwRecentChanges;  // Sequence number of the latest change queued for each hash of name and address
+	DWORD dwDroppedChanges;  // Queue was full
+	HANDLE hPendingEvent;  // Set when changes are queued or the updater is stopping
+	volatile LONG lStopping;
+	volatile LONG lUnavailable;  // The updater thread could not open its socket (and said so); nothing is queued
+	HANDLE hThread;
+	WORD wNextMessageId;  // Updater thread only
+};
+
+// Letters, digits, and hyphens (RFC 1123 section 2.1); other host names are not published
+bool IsValidDNSLabel(const char* const pcsLabel, const size_t stLength)
+{
+	ASSERT(0 != pcsLabel);
+	bool bValid = (1 <= stLength) && (stLength <= MAX_DNS_LABEL_LENGTH) && ('-' != pcsLabel[0]) && ('-' != pcsLabel[stLength - 1]);
+	for (size_t i = 0; bValid && (i < stLength); i++)
+	{
+		const char c = pcsLabel[i];
+		bValid = (('a' <= c) && (c <= 'z')) || (('A' <= c) && (c <= 'Z')) || (('0' <= c) && (c <= '9')) || ('-' == c);
+	}
+	return bValid;
+}
+
+// Zone names only need well-formed labels (RFC 2181 section 11)
+bool IsValidDNSName(const char* const pcsName)
+{
+	ASSERT(0 != pcsName);
+	const size_t stNameLength = strlen(pcsName);
+	bool bValid = (1 <= stNameLength) && (stNameLength <= MAX_DNS_NAME_LENGTH);
+	size_t stLabelLength = 0;
+	for (size_t i = 0; bValid && (i <= stNameLength); i++)
+	{
+		if (('.' == pcsName[i]) || ('\0' == pcsName[i]))
+		{
+			bValid = (1 <= stLabelLength) && (stLabelLength <= MAX_DNS_LABEL_LENGTH);
+			stLabelLength = 0;
+		}
+		else
+		{
+			stLabelLength++;
+		}
+	}
+	return bValid;
+}
+
+void RemoveTrailingDot(char* const pcsName)
+{
+	ASSERT(0 != pcsName);
+	const size_t stNameLength = strlen(pcsName);
+	if ((0 != stNameLength) && ('.' == pcsName[stNameLength - 1]))
+	{
+		pcsName[stNameLength - 1] = '\0';
+	}
+}
+
+bool WriteDNSBytes(DNSUpdateMessage* const pdum, const void* const pvData, const int iSize)
+{
+	ASSERT((0 != pdum) && ((0 == iSize) || (0 != pvData)));
+	const bool bFits = (pdum->iSize + iSize <= (int)sizeof(pdum->pbMessage));
+	if (bFits)
+	{
+		CopyMemory(pdum->pbMessage + pdum->iSize, pvData, iSize);
+		pdum->iSize += iSize;
+	}
+	return bFits;
+}
+
+bool WriteDNSWord(DNSUpdateMessage* const pdum, const WORD wValue)
+{
+	const WORD wNetworkValue = htons(wValue);
+	return WriteDNSBytes(pdum, &wNetworkValue, sizeof(wNetworkValue));
+}
+
+// Writes the labels of a dotted name (without the terminating root label)
+bool WriteDNSLabels(DNSUpdateMessage* const pdum, const char* const pcsName, const size_t stNameLength)
+{
+	ASSERT((0 != pdum) && (0 != pcsName));
+	bool bFits = true;
+	size_t stLabelStart = 0;
+	while (bFits && (stLabelStart < stNameLength))
+	{
+		const char* const pcsDot = (const char*)memchr(pcsName + stLabelStart, '.', stNameLength - stLabelStart);
+		const size_t stLabelLength = (0 != pcsDot) ? (size_t)(pcsDot - (pcsName + stLabelStart)) : (stNameLength - stLabelStart);
+		ASSERT((1 <= stLabelLength) && (stLabelLength <= MAX_DNS_LABEL_LENGTH));
+		const BYTE bLabelLength = (BYTE)stLabelLength;
+		bFits = WriteDNSBytes(pdum, &bLabelLength, sizeof(bLabelLength)) && WriteDNSBytes(pdum, pcsName + stLabelStart, (int)stLabelLength);
+		stLabelStart += stLabelLength + 1;
+	}
+	return bFits;
+}
+
+// The zone name always follows the header (RFC 1035 section 4.1.4)
+bool WriteDNSZoneNamePointer(DNSUpdateMessage* const pdum)
+{
+	return WriteDNSWord(pdum, 0xc000 | DNS_HEADER_SIZE);
+}
+
+bool WriteDNSRecordHeader(DNSUpdateMessage* const pdum, const WORD wType, const WORD wClass, const DWORD dwTTL, const WORD wDataLength)
+{
+	const DWORD dwNetworkTTL = htonl(dwTTL);
+	const bool bFits = WriteDNSWord(pdum, wType) && WriteDNSWord(pdum, wClass) && WriteDNSBytes(pdum, &dwNetworkTTL, sizeof(dwNetworkTTL)) && WriteDNSWord(pdum, wDataLength);
+	if (bFits)
+	{
+		pdum->wUpdates++;
+	}
+	return bFits;
+}
+
+// RFC 2136 section 2
+void InitializeDNSUpdateMessage(DNSUpdateMessage* const pdum, const WORD wMessageId, const char* const pcsZone)
+{
+	ASSERT((0 != pdum) && (0 != pcsZone));
+	pdum->iSize = 0;
+	pdum->wUpdates = 0;
+	// ID, opcode, then one zone and no prerequisites or additional records (UPCOUNT is set once the batch is complete)
+	const WORD pwHeader[DNS_HEADER_SIZE / sizeof(WORD)] = { wMessageId, dns_OPCODE_UPDATE << 11, 1, 0, 0, 0 };
+	for (size_t i = 0; i < ARRAY_LENGTH(pwHeader); i++)
+	{
+		VERIFY(WriteDNSWord(pdum, pwHeader[i]));
+	}
+	const BYTE bRootLabel = 0;
+	VERIFY(WriteDNSLabels(pdum, pcsZone, strlen(pcsZone)) && WriteDNSBytes(pdum, &bRootLabel, sizeof(bRootLabel)) &&
+		WriteDNSWord(pdum, dns_TYPE_SOA) && WriteDNSWord(pdum, dns_CLASS_IN));
+}
+
+void FinishDNSUpdateMessage(DNSUpdateMessage* const pdum)
+{
+	ASSERT(0 != pdum);
+	if (0 == pdum->wUpdates)
+	{
+		pdum->iSize = 0;  // Nothing to send
+	}
+	else
+	{
+		const WORD wNetworkUpdates = htons(pdum->wUpdates);
+		CopyMemory(pdum->pbMessage + 8, &wNetworkUpdates, sizeof(wNetworkUpdates));  // UPCOUNT
+	}
+}
+
+// A: an add replaces the name's address; a remove deletes only this address (RFC 2136 section 2.5)
+bool WriteForwardDNSUpdate(DNSUpdateMessage* const pdum, const DynamicDNSConfiguration* const pddc, const DynamicDNSChange* const pddcChange)
+{
+	ASSERT((0 != pdum) && (0 != pddc) && (0 != pddcChange));
+	const size_t stHostNameLength = strlen(pddcChange->pcsHostName);
+	bool bFits;
+	if (pddcChange->bAdd)
+	{
+		bFits = WriteDNSLabels(pdum, pddcChange->pcsHostName, stHostNameLength) && WriteDNSZoneNamePointer(pdum) &&
+			WriteDNSRecordHeader(pdum, dns_TYPE_A, dns_CLASS_ANY, 0, 0) &&
+			WriteDNSLabels(pdum, pddcChange->pcsHostName, stHostNameLength) && WriteDNSZoneNamePointer(pdum) &&
+			WriteDNSRecordHeader(pdum, dns_TYPE_A, dns_CLASS_IN, pddcChange->dwTTL, sizeof(pddcChange->dwAddr)) &&
+			WriteDNSBytes(pdum, &(pddcChange->dwAddr), sizeof(pddcChange->dwAddr));  // Already in network order
+	}
+	else
+	{
+		bFits = WriteDNSLabels(pdum, pddcChange->pcsHostName, stHostNameLength) && WriteDNSZoneNamePointer(pdum) &&
+			WriteDNSRecordHeader(pdum, dns_TYPE_A, dns_CLASS_NONE, 0, sizeof(pddcChange->dwAddr)) &&
+			WriteDNSBytes(pdum, &(pddcChange->dwAddr), sizeof(pddcChange->dwAddr));
+	}
+	return bFits;
+}
+
+// PTR: an add replaces the address's name; a remove deletes only this name
+bool WriteReverseDNSUpdate(DNSUpdateMessage* const pdum, const DynamicDNSConfiguration* const pddc, const DynamicDNSChange* const pddcChange)
+{
+	ASSERT((0 != pdum) && (0 != pddc) && (0 != pddcChange));
+	bool bFits = true;
+	// RFC 1035 section 3.5
+	const DWORD dwAddr = pddcChange->dwAddr;
+	char pcsReverseName[MAX_DNS_NAME_LENGTH + 1];
+	sprintf_s(pcsReverseName, sizeof(pcsReverseName), "%d.%d.%d.%d.in-addr.arpa", DWIP3(dwAddr), DWIP2(dwAddr), DWIP1(dwAddr), DWIP0(dwAddr));
+	const size_t stReverseNameLength = strlen(pcsReverseName);
+	const size_t stZoneLength = strlen(pddc->pcsReverseZone);
+	// Addresses outside the reverse zone are skipped
+	if ((stZoneLength < stReverseNameLength) && ('.' == pcsReverseName[stReverseNameLength - stZoneLength - 1]) &&
+		(0 == _stricmp(pcsReverseName + stReverseNameLength - stZoneLength, pddc->pcsReverseZone)))
+	{
+		const size_t stOwnerLength = stReverseNameLength - stZoneLength - 1;
+		const size_t stHostNameLength = strlen(pddcChange->pcsHostName);
+		const size_t stForwardZoneLength = strlen(pddc->pcsForwardZone);
+		const WORD wHostNameSize = (WORD)((1 + stHostNameLength) + (1 + stForwardZoneLength) + 1);  // Labels and root label, uncompressed
+		const BYTE bRootLabel = 0;
+		if (pddcChange->bAdd)
+		{
+			bFits = WriteDNSLabels(pdum, pcsReverseName, stOwnerLength) && WriteDNSZoneNamePointer(pdum) &&
+				WriteDNSRecordHeader(pdum, dns_TYPE_PTR, dns_CLASS_ANY, 0, 0);
+		}
+		bFits = bFits && WriteDNSLabels(pdum, pcsReverseName, stOwnerLength) && WriteDNSZoneNamePointer(pdum) &&
+			(pddcChange->bAdd ? WriteDNSRecordHeader(pdum, dns_TYPE_PTR, dns_CLASS_IN, pddcChange->dwTTL, wHostNameSize) : WriteDNSRecordHeader(pdum, dns_TYPE_PTR, dns_CLASS_NONE, 0, wHostNameSize)) &&
+			WriteDNSLabels(pdum, pddcChange->pcsHostName, stHostNameLength) && WriteDNSLabels(pdum, pddc->pcsForwardZone, stForwardZoneLength) &&
+			WriteDNSBytes(pdum, &bRootLabel, sizeof(bRootLabel));
+	}
+	return bFits;
+}
+
+bool LoadDynamicDNSConfiguration(DynamicDNSConfiguration* const pddc, const ServerConfigurationSource* const pscs)
+{
+	ASSERT((0 != pddc) && (0 != pscs));
+	bool bSuccess = true;
+	ZeroMemory(pddc, sizeof(*pddc));
+	if ('\0' != pscs->pcsFileName[0])
+	{
+		DWORD dwServerAddrValue = 0;
+		bSuccess = ReadConfigurationAddressValue(pscs->pcsFileName, "DNSServer", &dwServerAddrValue);
+		if (bSuccess && (0 != dwServerAddrValue))
+		{
+			GetPrivateProfileString(pcsConfigurationSection, "ForwardZone", "", pddc->pcsForwardZone, ARRAY_LENGTH(pddc->pcsForwardZone), pscs->pcsFileName);
+			GetPrivateProfileString(pcsConfigurationSection, "ReverseZone", "", pddc->pcsReverseZone, ARRAY_LENGTH(pddc->pcsReverseZone), pscs->pcsFileName);
+			// Zones may be written as absolute names
+			RemoveTrailingDot(pddc->pcsForwardZone);
+			RemoveTrailingDot(pddc->pcsReverseZone);
+			bSuccess = IsValidDNSName(pddc->pcsForwardZone) && (('\0' == pddc->pcsReverseZone[0]) || IsValidDNSName(pddc->pcsReverseZone)) &&
+				(strlen(pddc->pcsForwardZone) + strlen(pddc->pcsReverseZone) <= MAX_DYNAMIC_DNS_ZONE_NAMES_LENGTH);
+			if (bSuccess)
+			{
+				pddc->dwServerAddr = DWValuetoIP(dwServerAddrValue);
+				pddc->wServerPort = htons((u_short)DNS_SERVER_PORT);
+				const DWORD dwAddr = pddc->dwServerAddr;
+				OUTPUT((TEXT("Dynamic DNS:%d.%d.%d.%d - Forward zone:%hs - Reverse zone:%hs"), DWIP0(dwAddr), DWIP1(dwAddr), DWIP2(dwAddr), DWIP3(dwAddr),
+					pddc->pcsForwardZone, ('\0' != pddc->pcsReverseZone[0]) ? pddc->pcsReverseZone : "(none)"));
+			}
+			else
+			{
+				OUTPUT_ERROR((TEXT("Invalid ForwardZone or ReverseZone in configuration file.")));
+				OUTPUT_ERROR((TEXT("[ForwardZone is required with DNSServer, and the zone names can have at most %d characters together.]"), MAX_DYNAMIC_DNS_ZONE_NAMES_LENGTH));
+			}
+		}
+	}
+	return bSuccess;
+}
+
+// Packet thread; never blocks on DNS
+// FNV-1a; host names compare case-insensitively
+DWORD HashDynamicDNSChange(const DWORD dwAddr, const char* const pcsHostName)
+{
+	DWORD dwHash = 2166136261 ^ dwAddr;
+	for (size_t i = 0; '\0' != pcsHostName[i]; i++)
+	{
+		dwHash = (dwHash ^ (BYTE)tolower((BYTE)pcsHostName[i])) * 16777619;
+	}
+	return dwHash;
+}
+
+void QueueDynamicDNSChange(DynamicDNSUpdater* const pddu, const DWORD dwAddr, const char* const pcsHostName, const bool bAdd, const DWORD dwTTL)
+{
+	ASSERT((0 != pddu) && (0 != pcsHostName) && (!bAdd || (0 != dwTTL)));
+	const size_t stHostNameLength = strlen(pcsHostName);
+	if (IsValidDNSLabel(pcsHostName, stHostNameLength) && !pddu->lUnavailable)
+	{
+		DWORD* const pdwRecentChange = &(pddu->pdwRecentChanges[HashDynamicDNSChange(dwAddr, pcsHostName) & (DYNAMIC_DNS_CHANGE_HASH_BUCKETS - 1)]);
+		EnterCriticalSection(&(pddu->csPending));
+		if (pddu->dwNextChange - pddu->dwOldestChange < MAX_DYNAMIC_DNS_PENDING_CHANGES)
+		{
+			// A newer change for the same name and address supersedes a pending one (and is sent after any changes queued in between)
+			if (*pdwRecentChange - pddu->dwFirstPendingChange < pddu->dwNextChange - pddu->dwFirstPendingChange)
+			{
+				DynamicDNSChange* const pddcRecent = &(pddu->pddcPending[*pdwRecentChange & (MAX_DYNAMIC_DNS_PENDING_CHANGES - 1)]);
+				if ((dwAddr == pddcRecent->dwAddr) && (0 == _stricmp(pcsHostName, pddcRecent->pcsHostName)))
+				{
+					pddcRecent->bSuperseded = true;
+				}
+			}
+			DynamicDNSChange* const pddcChange = &(pddu->pddcPending[pddu->dwNextChange & (MAX_DYNAMIC_DNS_PENDING_CHANGES - 1)]);
+			pddcChange->dwAddr = dwAddr;
+			strncpy_s(pddcChange->pcsHostName, sizeof(pddcChange->pcsHostName), pcsHostName, _TRUNCATE);
+			pddcChange->dwTTL = dwTTL;
+			pddcChange->bAdd = bAdd;
+			pddcChange->bSuperseded = false;
+			*pdwRecentChange = pddu->dwNextChange;
+			pddu->dwNextChange++;
+		}
+		else
+		{
+			pddu->dwDroppedChanges++;
+		}
+		LeaveCriticalSection(&(pddu->csPending));
+		VERIFY(SetEvent(pddu->hPendingEvent));
+	}
+}
+
+// Builds the next batch from the oldest pending changes; returns true if more changes are pending
+bool TakeDynamicDNSBatch(DynamicDNSUpdater* const pddu, DynamicDNSBatch* const pddb)
+{
+	ASSERT((0 != pddu) && (0 != pddb) && (0 == pddb->dwChanges));
+	const DynamicDNSConfiguration* const pddc = &(pddu->ddcConfiguration);
+	const bool bReverse = ('\0' != pddc->pcsReverseZone[0]);
+	InitializeDNSUpdateMessage(&(pddb->dumForward), pddu->wNextMessageId++, pddc->pcsForwardZone);
+	InitializeDNSUpdateMessage(&(pddb->dumReverse), pddu->wNextMessageId++, bReverse ? pddc->pcsReverseZone : "");
+	// Claimed changes are neither reused nor superseded by the packet thread, so they are read without the lock
+	EnterCriticalSection(&(pddu->csPending));
+	ASSERT(pddu->dwOldestChange == pddu->dwFirstPendingChange);
+	const DWORD dwFirstChange = pddu->dwFirstPendingChange;
+	const DWORD dwClaimedChanges = min(pddu->dwNextChange - dwFirstChange, (DWORD)MAX_DYNAMIC_DNS_BATCH_CHANGES);
+	pddu->dwFirstPendingChange += dwClaimedChanges;
+	const DWORD dwDroppedChanges = pddu->dwDroppedChanges;
+	pddu->dwDroppedChanges = 0;
+	LeaveCriticalSection(&(pddu->csPending));
+	DWORD dwTakenChanges = 0;
+	bool bFits = true;
+	while (bFits && (dwTakenChanges < dwClaimedChanges))
+	{
+		const DynamicDNSChange* const pddcChange = &(pddu->pddcPending[(dwFirstChange + dwTakenChanges) & (MAX_DYNAMIC_DNS_PENDING_CHANGES - 1)]);
+		if (!pddcChange->bSuperseded)
+		{
+			// Both messages take the change or neither does
+			const int iForwardSize = pddb->dumForward.iSize;
+			const WORD wForwardUpdates = pddb->dumForward.wUpdates;
+			const int iReverseSize = pddb->dumReverse.iSize;
+			const WORD wReverseUpdates = pddb->dumReverse.wUpdates;
+			bFits = WriteForwardDNSUpdate(&(pddb->dumForward), pddc, pddcChange) && (!bReverse || WriteReverseDNSUpdate(&(pddb->dumReverse), pddc, pddcChange));
+			if (bFits)
+			{
+				pddb->dwChanges++;
+			}
+			else
+			{
+				pddb->dumForward.iSize = iForwardSize;
+				pddb->dumForward.wUpdates = wForwardUpdates;
+				pddb->dumReverse.iSize = iReverseSize;
+				pddb->dumReverse.wUpdates = wReverseUpdates;
+			}
+		}
+		if (bFits)
+		{
+			dwTakenChanges++;
+		}
+	}
+	ASSERT((0 == dwClaimedChanges) || (0 != dwTakenChanges));  // A single change always fits (see MAX_DYNAMIC_DNS_ZONE_NAMES_LENGTH)
+	// The messages hold copies of the taken changes, so their slots are released; changes that did not fit are pending again
+	EnterCriticalSection(&(pddu->csPending));
+	pddu->dwFirstPendingChange = dwFirstChange + dwTakenChanges;
+	pddu->dwOldestChange = pddu->dwFirstPendingChange;
+	const bool bMorePending = (pddu->dwNextChange != pddu->dwFirstPendingChange);
+	LeaveCriticalSection(&(pddu->csPending));
+	FinishDNSUpdateMessage(&(pddb->dumForward));
+	FinishDNSUpdateMessage(&(pddb->dumReverse));
+	if (0 != dwDroppedChanges)
+	{
+		OUTPUT_ERROR((TEXT("Dynamic DNS queue is full; %u change(s) dropped."), dwDroppedChanges));
+	}
+	return bMorePending;
+}
+
+// Returns the response code, or -1 if the server did not answer
+int SendDNSUpdateMessage(const SOCKET sDNSSocket, const DNSUpdateMessage* const pdum)
+{
+	ASSERT((INVALID_SOCKET != sDNSSocket) && (0 != pdum) && (DNS_HEADER_SIZE < pdum->iSize));
+	int iResponseCode = -1;
+	if (SOCKET_ERROR != send(sDNSSocket, (const char*)pdum->pbMessage, pdum->iSize, 0))
+	{
+		bool bWaiting = true;
+		while (bWaiting)
+		{
+			fd_set fdsRead;
+			FD_ZERO(&fdsRead);
+			FD_SET(sDNSSocket, &fdsRead);
+			timeval tvTimeout;
+			tvTimeout.tv_sec = DYNAMIC_DNS_RESPONSE_TIMEOUT_SECONDS;
+			tvTimeout.tv_usec = 0;
+			BYTE pbResponse[MAX_DNS_UDP_MESSAGE_SIZE];
+			const int iResponseSize = (1 == select(0, &fdsRead, 0, 0, &tvTimeout)) ? recv(sDNSSocket, (char*)pbResponse, sizeof(pbResponse), 0) : SOCKET_ERROR;
+			if (DNS_HEADER_SIZE <= iResponseSize)
+			{
+				// Ignore anything but the response to this message (such as a late response to an earlier attempt)
+				if ((0 == memcmp(pbResponse, pdum->pbMessage, sizeof(WORD))) && (0 != (0x80 & pbResponse[2])) && (dns_OPCODE_UPDATE == ((pbResponse[2] >> 3) & 0xf)))
+				{
+					iResponseCode = pbResponse[3] & 0xf;
+					bWaiting = false;
+				}
+			}
+			else
+			{
+				// Keep waiting after a runt datagram, but not after a timeout or error (such as an unreachable server)
+				bWaiting = (0 <= iResponseSize);
+			}
+		}
+	}
+	return iResponseCode;
+}
+
+// Returns true if the batch should be retried
+bool SendDynamicDNSBatch(const SOCKET sDNSSocket, const DynamicDNSConfiguration* const pddc, DynamicDNSBatch* const pddb)
+{
+	ASSERT((INVALID_SOCKET != sDNSSocket) && (0 != pddc) && (0 != pddb) && (0 != pddb->dwChanges));
+	DNSUpdateMessage* const ppdumMessages[] = { &(pddb->dumForward), &(pddb->dumReverse) };
+	const char* const ppcsZones[] = { pddc->pcsForwardZone, pddc->pcsReverseZone };
+	C_ASSERT(ARRAY_LENGTH(ppdumMessages) == ARRAY_LENGTH(ppcsZones));
+	bool bRetry = false;
+	for (size_t i = 0; i < ARRAY_LENGTH(ppdumMessages); i++)
+	{
+		DNSUpdateMessage* const pdum = ppdumMessages[i];
+		if (0 != pdum->iSize)
+		{
+			const int iResponseCode = SendDNSUpdateMessage(sDNSSocket, pdum);
+			if ((-1 == iResponseCode) || (dns_RCODE_SERVFAIL == iResponseCode))
+			{
+				bRetry = true;
+			}
+			else
+			{
+				if (dns_RCODE_NOERROR != iResponseCode)
+				{
+					// Not authoritative, refused, etc.; retrying won't help
+					OUTPUT_ERROR((TEXT("DNS server rejected update of zone \"%hs\" (response code %d)."), ppcsZones[i], iResponseCode));
+				}
+				pdum->iSize = 0;
+			}
+		}
+	}
+	if (!bRetry)
+	{
+		OUTPUT((TEXT("Sent %u dynamic DNS change(s)."), pddb->dwChanges));
+		pddb->dwChanges = 0;
+	}
+	return bRetry;
+}
+
+DWORD WINAPI DynamicDNSThreadProc(LPVOID pvParameter)
+{
+	DynamicDNSUpdater* const pddu = (DynamicDNSUpdater*)pvParameter;
+	ASSERT(0 != pddu);
+	const SOCKET sDNSSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (INVALID_SOCKET != sDNSSocket)
+	{
+		// Connected, so only datagrams from the DNS server are received
+		SOCKADDR_IN saDNSServerAddress;
+		saDNSServerAddress.sin_family = AF_INET;
+		saDNSServerAddress.sin_addr.s_addr = pddu->ddcConfiguration.dwServerAddr;  // Already in network byte order
+		saDNSServerAddress.sin_port = pddu->ddcConfiguration.wServerPort;  // Already in network byte order
+		if (SOCKET_ERROR != connect(sDNSSocket, (SOCKADDR*)(&saDNSServerAddress), sizeof(saDNSServerAddress)))
+		{
+			DynamicDNSBatch ddbBatch;
+			ddbBatch.dwChanges = 0;
+			DWORD dwAttempts = 0;
+			ULONGLONG qwRetryTime = 0;
+			bool bCheckPending = false;
+			while (!pddu->lStopping)
+			{
+				DWORD dwWaitMilliseconds = INFINITE;  // Until changes are queued
+				if (0 != ddbBatch.dwChanges)
+				{
+					const ULONGLONG qwNow = GetTickCount64();
+					dwWaitMilliseconds = (qwNow < qwRetryTime) ? (DWORD)(qwRetryTime - qwNow) : 0;
+				}
+				else if (bCheckPending)
+				{
+					dwWaitMilliseconds = 0;
+				}
+				WaitForSingleObject(pddu->hPendingEvent, dwWaitMilliseconds);
+				if ((0 == ddbBatch.dwChanges) && !pddu->lStopping)
+				{
+					if (INFINITE == dwWaitMilliseconds)
+					{
+						// Was idle; let changes that arrive together be sent together
+						Sleep(DYNAMIC_DNS_BATCH_DELAY_MILLISECONDS);
+					}
+					bCheckPending = TakeDynamicDNSBatch(pddu, &ddbBatch);
+					dwAttempts = 0;
+					qwRetryTime = 0;
+				}
+				if ((0 != ddbBatch.dwChanges) && (qwRetryTime <= GetTickCount64()) && !pddu->lStopping)
+				{
+					dwAttempts++;
+					if (SendDynamicDNSBatch(sDNSSocket, &(pddu->ddcConfiguration), &ddbBatch))
+					{
+						if (dwAttempts < MAX_DYNAMIC_DNS_ATTEMPTS)
+						{
+							qwRetryTime = GetTickCount64() + min(DYNAMIC_DNS_FIRST_RETRY_MILLISECONDS << (dwAttempts - 1), DYNAMIC_DNS_MAX_RETRY_MILLISECONDS);
+						}
+						else
+						{
+							OUTPUT_ERROR((TEXT("DNS server did not answer after %u attempts; %u dynamic DNS change(s) dropped."), dwAttempts, ddbBatch.dwChanges));
+							ddbBatch.dwChanges = 0;
+						}
+					}
+					// Changes queued while this batch was retried may not have left the event set
+					bCheckPending = bCheckPending || (0 == ddbBatch.dwChanges);
+				}
+			}
+		}
+		else
+		{
+			OUTPUT_ERROR((TEXT("Unable to connect to DNS server (error %d); dynamic DNS is unavailable."), WSAGetLastError()));
+			InterlockedExchange(&(pddu->lUnavailable), TRUE);
+		}
+		VERIFY(0 == closesocket(sDNSSocket));
+	}
+	else
+	{
+		OUTPUT_ERROR((TEXT("Unable to open dynamic DNS socket; dynamic DNS is unavailable.")));
+		InterlockedExchange(&(pddu->lUnavailable), TRUE);
+	}
+	return 0;
+}
+
+bool StartDynamicDNSUpdater(DynamicDNSUpdater* const pddu, const DynamicDNSConfiguration* const pddc)
+{
+	ASSERT((0 != pddu) && (0 != pddc) && (0 != pddc->dwServerAddr));
+	bool bSuccess = false;
+	pddu->ddcConfiguration = *pddc;
+	pddu->pddcPending = (DynamicDNSChange*)LocalAlloc(LMEM_FIXED, MAX_DYNAMIC_DNS_PENDING_CHANGES * sizeof(DynamicDNSChange));
+	pddu->pdwRecentChanges = (DWORD*)LocalAlloc(LMEM_FIXED | LMEM_ZEROINIT, DYNAMIC_DNS_CHANGE_HASH_BUCKETS * sizeof(DWORD));
+	if ((0 != pddu->pddcPending) && (0 != pddu->pdwRecentChanges))
+	{
+		pddu->dwOldestChange = 0;
+		pddu->dwFirstPendingChange = 0;
+		pddu->dwNextChange = 0;  // Buckets start at 0, so none refers to a pending change yet
+		pddu->dwDroppedChanges = 0;
+		pddu->lStopping = FALSE;
+		pddu->lUnavailable = FALSE;
+		pddu->wNextMessageId = (WORD)GetTickCount64();  // Unlikely to match a previous run's IDs
+		pddu->hPendingEvent = CreateEvent(0, FALSE, FALSE, 0);
+		if (0 != pddu->hPendingEvent)
+		{
+			InitializeCriticalSection(&(pddu->csPending));
+			pddu->hThread = CreateThread(0, 0, DynamicDNSThreadProc, pddu, 0, 0);
+			if (0 != pddu->hThread)
+			{
+				bSuccess = true;
+			}
+			else
+			{
+				DeleteCriticalSection(&(pddu->csPending));
+				VERIFY(CloseHandle(pddu->hPendingEvent));
+			}
+		}
+	}
+	if (!bSuccess)
+	{
+		if (0 != pddu->pddcPending)
+		{
+			VERIFY(0 == LocalFree(pddu->pddcPending));
+		}
+		if (0 != pddu->pdwRecentChanges)
+		{
+			VERIFY(0 == LocalFree(pddu->pdwRecentChanges));
+		}
+		OUTPUT_ERROR((TEXT("Unable to start dynamic DNS thread; host names are not published.")));
+	}
+	return bSuccess;
+}
+
+// Once the packet thread has stopped; changes still pending are discarded
+void StopDynamicDNSUpdater(DynamicDNSUpdater* const pddu)
+{
+	ASSERT((0 != pddu) && (0 != pddu->hThread));
+	InterlockedExchange(&(pddu->lStopping), TRUE);
+	VERIFY(SetEvent(pddu->hPendingEvent));
+	VERIFY(WAIT_OBJECT_0 == WaitForSingleObject(pddu->hThread, INFINITE));
+	VERIFY(CloseHandle(pddu->hThread));
+	pddu->hThread = 0;
+	VERIFY(CloseHandle(pddu->hPendingEvent));
+	DeleteCriticalSection(&(pddu->csPending));
+	VERIFY(0 == LocalFree(pddu->pddcPending));
+	VERIFY(0 == LocalFree(pddu->pdwRecentChanges));
+}
+
+void HandleDHCPEngineEvent(void* pvContext, const DHCPEngineEvent* pdeeEvent)
+{
+	DynamicDNSUpdater* const pddu = (DynamicDNSUpdater*)pvContext;  // 0 if dynamic DNS is off
+	ASSERT(0 != pdeeEvent);
+	const DWORD dwAddr = pdeeEvent->dwAddr;
+	switch (pdeeEvent->deetType)
+	{
+	case DHCPEngineEventType_OFFERED:
+		OUTPUT((TEXT("Offering client \"%hs\" IP address %d.%d.%d.%d"), pdeeEvent->pcsHostName, DWIP0(dwAddr), DWIP1(dwAddr), DWIP2(dwAddr), DWIP3(dwAddr)));
+		break;
+	case DHCPEngineEventType_EXHAUSTED:
+		OUTPUT_ERROR((TEXT("No more IP addresses available for client \"%hs\""), pdeeEvent->pcsHostName));
+		break;
+	case DHCPEngineEventType_ACKED:
+		OUTPUT((TEXT("Acknowledging client \"%hs\" has IP address %d.%d.%d.%d"), pdeeEvent->pcsHostName, DWIP0(dwAddr), DWIP1(dwAddr), DWIP2(dwAddr), DWIP3(dwAddr)));
+		if (0 != pddu)
+		{
+			QueueDynamicDNSChange(pddu, dwAddr, pdeeEvent->pcsHostName, true, pdeeEvent->dwLeaseTime);
+		}
+		break;
+	case DHCPEngineEventType_NAKED:
+		OUTPUT((TEXT("Denying client \"%hs\" unoffered IP address."), pdeeEvent->pcsHostName));
+		break;
+	case DHCPEngineEventType_RELEASED:
+		OUTPUT((TEXT("Client \"%hs\" released IP address %d.%d.%d.%d"), pdeeEvent->pcsHostName, DWIP0(dwAddr), DWIP1(dwAddr), DWIP2(dwAddr), DWIP3(dwAddr)));
+		if (0 != pddu)
+		{
+			QueueDynamicDNSChange(pddu, dwAddr, pdeeEvent->pcsHostName, false, 0);
+		}
+		break;
+	case DHCPEngineEventType_RENAMED:
+		OUTPUT((TEXT("Client \"%hs\" with IP address %d.%d.%d.%d is now \"%hs\""), pdeeEvent->pcsPreviousHostName, DWIP0(dwAddr), DWIP1(dwAddr), DWIP2(dwAddr), DWIP3(dwAddr), pdeeEvent->pcsHostName));
+		if (0 != pddu)
+		{
+			// The new name is published when the lease is next acknowledged
+			QueueDynamicDNSChange(pddu, dwAddr, pdeeEvent->pcsPreviousHostName, false, 0);
+		}
+		break;
+	case DHCPEngineEventType_DROPPED:
+		// Counted by RELOADED
+		if (0 != pddu)
+		{
+			QueueDynamicDNSChange(pddu, dwAddr, pdeeEvent->pcsHostName, false, 0);
+		}
+		break;
+	case DHCPEngineEventType_INVALIDMESSAGE:
+		OUTPUT_WARNING((pdeeEvent->pcsDescription));
+		break;
+	case DHCPEngineEventType_OFFERSEXPIRED:
+		OUTPUT((TEXT("%u offer(s) expired without a request."), pdeeEvent->dwCount));
+		break;
+	case DHCPEngineEventType_RELOADED:
+		OUTPUT((TEXT("Configuration reloaded (%u lease(s) migrated, %u dropped)."), pdeeEvent->dwCount, pdeeEvent->dwDropped));
+		break;
+	default:
+		ASSERT(!"Invalid DHCPEngineEventType");
+		break;
+	}
+}
+
+// Wake up periodically so offers expire and a reload takes effect even when no messages arrive
+#define RELOAD_POLL_INTERVAL_SECONDS (1)
+
+bool ReadDHCPClientRequests(const SOCKET sServerSocket, DHCPEngine* const pde, FlightRecorder* const pfr)
+{
+	ASSERT((INVALID_SOCKET != sServerSocket) && (0 != pde) && (0 != pfr));
+	bool bSuccess = false;
+	BYTE* const pbReadBuffer = (BYTE*)LocalAlloc(LMEM_FIXED, MAX_UDP_MESSAGE_SIZE);
+	if (0 != pbReadBuffer)
+	{
+		bSuccess = true;
+		int iLastError = 0;
+		ASSERT(WSAENOTSOCK != iLastError);
+		while (WSAENOTSOCK != iLastError)
+		{
+			fd_set fdsRead;
+			FD_ZERO(&fdsRead);
+			FD_SET(sServerSocket, &fdsRead);
+			timeval tvTimeout;
+			tvTimeout.tv_sec = RELOAD_POLL_INTERVAL_SECONDS;
+			tvTimeout.tv_usec = 0;
+			const int iReady = select(0, &fdsRead, 0, 0, &tvTimeout);
+			if (0 == iReady)
+			{
+				UpdateDHCPEngine(pde, GetTickCount64());
+			}
+			else
+			{
+				SOCKADDR_IN saClientAddress;
+				int iClientAddressSize = sizeof(saClientAddress);
+				const int iBytesReceived = (SOCKET_ERROR != iReady) ?
+					recvfrom(sServerSocket, (char*)pbReadBuffer, MAX_UDP_MESSAGE_SIZE, 0, (SOCKADDR*)(&saClientAddress), &iClientAddressSize) : SOCKET_ERROR;
+				if (SOCKET_ERROR != iBytesReceived)
+				{
+					// ASSERT(DHCP_CLIENT_PORT == ntohs(saClientAddress.sin_port));  // Not always the case
+					FlightRecord* const pfrRecord = BeginFlightRecord(pfr, pbReadBuffer, iBytesReceived);
+					LARGE_INTEGER liStart;
+					VERIFY(QueryPerformanceCounter(&liStart));
+					BYTE pbReplyBuffer[MAX_DHCP_REPLY_SIZE];
+					DWORD dwReplyAddr;
+					const int iReplySize = ProcessDHCPClientRequest(pde, pbReadBuffer, iBytesReceived, GetTickCount64(), pbReplyBuffer, sizeof(pbReplyBuffer), &dwReplyAddr, pfrRecord);
+					if (0 != iReplySize)
+					{
+						SOCKADDR_IN saReplyAddress;
+						saReplyAddress.sin_family = AF_INET;
+						saReplyAddress.sin_addr.s_addr = dwReplyAddr;  // Already in network order
+						saReplyAddress.sin_port = htons((u_short)DHCP_CLIENT_PORT);
+						VERIFY(SOCKET_ERROR != sendto(sServerSocket, (char*)pbReplyBuffer, iReplySize, 0, (SOCKADDR*)&saReplyAddress, sizeof(saReplyAddress)));
+					}
+					LARGE_INTEGER liEnd;
+					VERIFY(QueryPerformanceCounter(&liEnd));
+					EndFlightRecord(pfr, pfrRecord, liEnd.QuadPart - liStart.QuadPart);
+				}
+				else
+				{
+					iLastError = WSAGetLastError();
+					if (WSAENOTSOCK == iLastError)
+					{
+						OUTPUT((TEXT("Stopping server request handler.")));
+					}
+					else if (WSAEINTR == iLastError)
+					{
+						OUTPUT((TEXT("Socket operation was cancelled.")));
+					}
+					else
+					{
+						OUTPUT_ERROR((TEXT("Call to select or recvfrom returned error %d."), iLastError));
+					}
+				}
+			}
+		}
+		VERIFY(0 == LocalFree(pbReadBuffer));
+	}
+	else
+	{
+		OUTPUT_ERROR((TEXT("Unable to allocate memory for client datagram read buffer.")));
+	}
+	return bSuccess;
+}
+
+// Admin queries are answered over a local named pipe by their own thread, which
+// copies lease table snapshots and never blocks the packet thread
+const TCHAR ptsAdminPipeName[] = TEXT("\\\\.\\pipe\\DHCPLite");
+#define MAX_ADMIN_REQUEST_LENGTH (512)
+#define MAX_ADMIN_LINE_LENGTH (512)
+#define ADMIN_OUTPUT_BUFFER_SIZE (4096)
+// Give up on a snapshot if the packet thread keeps updating the table
+#define MAX_SNAPSHOT_ATTEMPTS (16)
+// A dump copies this many slots per snapshot, so each copy is short enough for the packet thread to rarely interrupt it
+#define SNAPSHOT_CHUNK_SLOTS (64)
+// Different clients may report the same host name
+#define MAX_HOSTNAME_MATCHES (16)
+// Option data length is a single byte (RFC 2132 section 2)
+#define MAX_OPTION_DATA_LENGTH (255)
+// Hardware type for Ethernet (RFC 1700)
+#define HTYPE_ETHERNET (1)
+
+enum AdminQueryTypes
+{
+	AdminQueryType_ALL,
+	AdminQueryType_ADDRESS,
+	AdminQueryType_CLIENTIDENTIFIER,
+	AdminQueryType_MAC,
+	AdminQueryType_HOSTNAME,
+};
+struct AdminQuery
+{
+	AdminQueryTypes aqtType;
+	DWORD dwAddrValue;
+	BYTE pbClientIdentifier[MAX_OPTION_DATA_LENGTH];  // Or hardware address
+	DWORD dwClientIdentifierSize;
+	char pcsHostName[MAX_STORED_HOSTNAME_LENGTH];
+};
+
+// A dump collects the leases in SNAPSHOT_CHUNK_SLOTS slots from dwFirstSlot; other queries ignore dwFirstSlot
+DWORD CollectLeases(const LeaseTable* const plt, const AdminQuery* const paq, const DWORD dwFirstSlot, AddressInUseInformation* const paiuiLeases, const DWORD dwMaxLeases)
+{
+	ASSERT((0 != plt) && (0 != paq) && (0 != paiuiLeases));
+	DWORD dwLeases = 0;
+	switch (paq->aqtType)
+	{
+	case AdminQueryType_ALL:
+		for (DWORD i = dwFirstSlot; (i < min(dwFirstSlot + SNAPSHOT_CHUNK_SLOTS, plt->dwSlotCount)) && (dwLeases < dwMaxLeases); i++)
+		{
+			if (LeaseState_FREE != plt->paiuiSlots[i].lsState)
+			{
+				paiuiLeases[dwLeases++] = plt->paiuiSlots[i];
+			}
+		}
+		break;
+	case AdminQueryType_ADDRESS:
+	{
+		const int iIndex = FindLeaseTableIndexOfAddress(plt, paq->dwAddrValue);
+		if ((-1 != iIndex) && (LeaseState_FREE != plt->paiuiSlots[iIndex].lsState) && (dwLeases < dwMaxLeases))
+		{
+			paiuiLeases[dwLeases++] = plt->paiuiSlots[iIndex];
+		}
+	}
+	break;
+	case AdminQueryType_CLIENTIDENTIFIER:
+	{
+		const int iIndex = FindLeaseTableIndexOfClientIdentifier(plt, paq->pbClientIdentifier, paq->dwClientIdentifierSize);
+		if ((-1 != iIndex) && (dwLeases < dwMaxLeases))
+		{
+			paiuiLeases[dwLeases++] = plt->paiuiSlots[iIndex];
+		}
+	}
+	break;
+	case AdminQueryType_MAC:
+	{
+		// Clients are identified by the client identifier option (usually hardware type then address) or by chaddr (RFC 2132 section 9.14)
+		BYTE pbClientIdentifier[1 + sizeof(((DHCPMessage*)0)->chaddr)];
+		pbClientIdentifier[0] = HTYPE_ETHERNET;
+		CopyMemory(pbClientIdentifier + 1, paq->pbClientIdentifier, paq->dwClientIdentifierSize);
+		int iIndex = FindLeaseTableIndexOfClientIdentifier(plt, pbClientIdentifier, 1 + paq->dwClientIdentifierSize);
+		if (-1 == iIndex)
+		{
+			BYTE pbChaddr[sizeof(((DHCPMessage*)0)->chaddr)];
+			ZeroMemory(pbChaddr, sizeof(pbChaddr));
+			CopyMemory(pbChaddr, paq->pbClientIdentifier, paq->dwClientIdentifierSize);
+			iIndex = FindLeaseTableIndexOfClientIdentifier(plt, pbChaddr, sizeof(pbChaddr));
+		}
+		if ((-1 != iIndex) && (dwLeases < dwMaxLeases))
+		{
+			paiuiLeases[dwLeases++] = plt->paiuiSlots[iIndex];
+		}
+	}
+	break;
+	case AdminQueryType_HOSTNAME:
+	{
+		int piIndexes[MAX_HOSTNAME_MATCHES];
+		const DWORD dwIndexes = FindLeaseTableIndexesOfHostName(plt, paq->pcsHostName, piIndexes, min((DWORD)ARRAY_LENGTH(piIndexes), dwMaxLeases));
+		for (DWORD i = 0; i < dwIndexes; i++)
+		{
+			paiuiLeases[dwLeases++] = plt->paiuiSlots[piIndexes[i]];
+		}
+	}
+	break;
+	default:
+		ASSERT(!"Invalid AdminQueryType");
+		break;
+	}
+	return dwLeases;
+}
+
+bool SnapshotLeases(const LeaseTable* const plt, const AdminQuery* const paq, const DWORD dwFirstSlot, AddressInUseInformation* const paiuiLeases, const DWORD dwMaxLeases, DWORD* const pdwLeases)
+{
+	ASSERT((0 != plt) && (0 != paq) && (0 != paiuiLeases) && (0 != pdwLeases));
+	bool bSuccess = false;
+	for (int iAttempt = 0; !bSuccess && (iAttempt < MAX_SNAPSHOT_ATTEMPTS); iAttempt++)
+	{
+		const LONG lSequence = plt->lSequence;
+		MemoryBarrier();
+		if (0 == (lSequence & 1))
+		{
+			*pdwLeases = CollectLeases(plt, paq, dwFirstSlot, paiuiLeases, dwMaxLeases);
+			MemoryBarrier();
+			bSuccess = (lSequence == plt->lSequence);
+		}
+		if (!bSuccess)
+		{
+			SwitchToThread();
+		}
+	}
+	return bSuccess;
+}
+
+struct AdminOutput
+{
+	HANDLE hPipe;
+	bool bFailed;
+	size_t stBufferUsed;
+	char pcsBuffer[ADMIN_OUTPUT_BUFFER_SIZE];
+};
+
+void FlushAdminOutput(AdminOutput* const pao)
+{
+	ASSERT(0 != pao);
+	if (!pao->bFailed && (0 != pao->stBufferUsed))
+	{
+		DWORD dwBytesWritten;
+		pao->bFailed = !WriteFile(pao->hPipe, pao->pcsBuffer, (DWORD)pao->stBufferUsed, &dwBytesWritten, 0) || (pao->stBufferUsed != dwBytesWritten);
+	}
+	pao->stBufferUsed = 0;
+}
+
+void AdminOutputLine(AdminOutput* const pao, const char* const pcsFormat, ...)
+{
+	ASSERT((0 != pao) && (0 != pcsFormat));
+	char pcsLine[MAX_ADMIN_LINE_LENGTH];
+	va_list vaArguments;
+	va_start(vaArguments, pcsFormat);
+	_vsnprintf_s(pcsLine, sizeof(pcsLine) - sizeof(ptsCRLF) + 1, _TRUNCATE, pcsFormat, vaArguments);
+	va_end(vaArguments);
+	strcat_s(pcsLine, sizeof(pcsLine), ptsCRLF);
+	const size_t stLineLength = strlen(pcsLine);
+	if (sizeof(pao->pcsBuffer) < pao->stBufferUsed + stLineLength)
+	{
+		FlushAdminOutput(pao);
+	}
+	CopyMemory(pao->pcsBuffer + pao->stBufferUsed, pcsLine, stLineLength);
+	pao->stBufferUsed += stLineLength;
+}
+
+void AdminOutputLease(AdminOutput* const pao, const AddressInUseInformation* const paiui)
+{
+	ASSERT((0 != pao) && (0 != paiui));
+	char pcsClientIdentifier[(3 * MAX_STORED_CLIENT_IDENTIFIER_LENGTH) + 4];
+	pcsClientIdentifier[0] = '\0';
+	const DWORD dwStoredSize = StoredClientIdentifierSize(paiui->dwClientIdentifierSize);
+	for (DWORD i = 0; i < dwStoredSize; i++)
+	{
+		sprintf_s(pcsClientIdentifier + (3 * i), sizeof(pcsClientIdentifier) - (3 * i), "%02x-", paiui->pbClientIdentifier[i]);
+	}
+	if (0 != dwStoredSize)
+	{
+		pcsClientIdentifier[(3 * dwStoredSize) - 1] = '\0';  // Trailing separator
+	}
+	if (dwStoredSize < paiui->dwClientIdentifierSize)
+	{
+		strcat_s(pcsClientIdentifier, sizeof(pcsClientIdentifier), "...");
+	}
+	const DWORD dwAddr = DWValuetoIP(paiui->dwAddrValue);
+	ASSERT(paiui->lsState < LeaseState_COUNT);
+	AdminOutputLine(pao, "%d.%d.%d.%d %s \"%.*s\" %s", DWIP0(dwAddr), DWIP1(dwAddr), DWIP2(dwAddr), DWIP3(dwAddr),
+		(0 == paiui->dwClientIdentifierSize) ? "(server)" : pcsClientIdentifier, MAX_STORED_HOSTNAME_LENGTH - 1, paiui->pcsHostName, ppcsLeaseStateNames[paiui->lsState]);
+}
+
+void ReloadServerConfiguration(AdminOutput* const pao, DHCPEngine* const pde, const ServerConfigurationSource* const pscs)
+{
+	ASSERT((0 != pao) && (0 != pde) && (0 != pscs));
+	ServerConfiguration scConfiguration;
+	if (LoadServerConfiguration(&scConfiguration, pscs))
+	{
+		// The server socket is bound to the original address
+		if (scConfiguration.dwServerAddr == GetCurrentDHCPEngineState(pde)->scConfiguration.dwServerAddr)
+		{
+			if (QueueDHCPEngineConfiguration(pde, &scConfiguration))
+			{
+				// The packet thread applies it within RELOAD_POLL_INTERVAL_SECONDS; the pipe is not held until then
+				AdminOutputLine(pao, "Reload queued; existing leases are migrated when it takes effect (\"reload status\" reports when it has).");
+			}
+			else
+			{
+				AdminOutputLine(pao, "ERROR: Insufficient memory for lease table.");
+			}
+		}
+		else
+		{
+			AdminOutputLine(pao, "ERROR: Server address changed; restart DHCPLite to use it.");
+		}
+	}
+	else
+	{
+		AdminOutputLine(pao, "ERROR: Unable to load configuration (details are on the server console).");
+	}
+}
+
+void ReportReloadStatus(AdminOutput* const pao, DHCPEngine* const pde)
+{
+	ASSERT((0 != pao) && (0 != pde));
+	if (IsDHCPEngineConfigurationPending(pde))
+	{
+		AdminOutputLine(pao, "Reload pending.");
+	}
+	else
+	{
+		// The replaced lease table is freed here rather than when the next admin request happens to arrive (this thread holds no references to it)
+		FreeRetiredDHCPEngineStates(pde);
+		AdminOutputLine(pao, "No reload pending; the last reload (if any) has taken effect (details are on the server console).");
+	}
+}
+
+void ProcessAdminRequest(AdminOutput* const pao, DHCPEngine* const pde, const ServerConfigurationSource* const pscs, FlightRecorder* const pfr, char* const pcsRequest)
+{
+	ASSERT((0 != pao) && (0 != pde) && (0 != pscs) && (0 != pfr) && (0 != pcsRequest));
+	// Requests are "<command> [argument]"
+	char* pcsArgument = strchr(pcsRequest, ' ');
+	if (0 != pcsArgument)
+	{
+		*pcsArgument = '\0';
+		pcsArgument++;
+	}
+	else
+	{
+		pcsArgument = pcsRequest + strlen(pcsRequest);
+	}
+	AdminQuery aqQuery;
+	ZeroMemory(&aqQuery, sizeof(aqQuery));
+	bool bValidQuery = false;
+	bool bTraceRequest = false;
+	bool bReloadRequest = false;
+	bool bReloadStatusRequest = false;
+	if (0 == _stricmp(pcsRequest, "dump"))
+	{
+		aqQuery.aqtType = AdminQueryType_ALL;
+		bValidQuery = true;
+	}
+	else if (0 == _stricmp(pcsRequest, "ip"))
+	{
+		aqQuery.aqtType = AdminQueryType_ADDRESS;
+		bValidQuery = ParseAddressValue(pcsArgument, &(aqQuery.dwAddrValue));
+	}
+	else if (0 == _stricmp(pcsRequest, "mac"))
+	{
+		aqQuery.aqtType = AdminQueryType_MAC;
+		bValidQuery = ParseHexBytes(pcsArgument, aqQuery.pbClientIdentifier, sizeof(((DHCPMessage*)0)->chaddr), &(aqQuery.dwClientIdentifierSize));
+	}
+	else if (0 == _stricmp(pcsRequest, "client"))
+	{
+		aqQuery.aqtType = AdminQueryType_CLIENTIDENTIFIER;
+		bValidQuery = ParseHexBytes(pcsArgument, aqQuery.pbClientIdentifier, sizeof(aqQuery.pbClientIdentifier), &(aqQuery.dwClientIdentifierSize));
+	}
+	else if (0 == _stricmp(pcsRequest, "host"))
+	{
+		aqQuery.aqtType = AdminQueryType_HOSTNAME;
+		strncpy_s(aqQuery.pcsHostName, sizeof(aqQuery.pcsHostName), pcsArgument, _TRUNCATE);
+		bValidQuery = ('\0' != aqQuery.pcsHostName[0]);
+	}
+	else if (0 == _stricmp(pcsRequest, "trace"))
+	{
+		bTraceRequest = true;
+	}
+	else if (0 == _stricmp(pcsRequest, "reload"))
+	{
+		bReloadRequest = ('\0' == pcsArgument[0]);
+		bReloadStatusRequest = (0 == _stricmp(pcsArgument, "status"));
+	}
+	if (bTraceRequest)
+	{
+		// Binary flight recorder file (decode with "DHCPLite /decode <file>")
+		FlushAdminOutput(pao);
+		pao->bFailed = !WriteFlightRecorder(pfr, pao->hPipe);
+	}
+	else if (bReloadRequest)
+	{
+		ReloadServerConfiguration(pao, pde, pscs);
+	}
+	else if (bReloadStatusRequest)
+	{
+		ReportReloadStatus(pao, pde);
+	}
+	else if (bValidQuery)
+	{
+		const LeaseTable* const plt = &(GetCurrentDHCPEngineState(pde)->ltAddressesInUse);
+		AddressInUseInformation paiuiLeases[SNAPSHOT_CHUNK_SLOTS];
+		C_ASSERT(MAX_HOSTNAME_MATCHES <= ARRAY_LENGTH(paiuiLeases));
+		// A dump is taken (and written) one chunk at a time, so each lease is consistent but leases in different chunks may be from different moments
+		const DWORD dwSlotCount = (AdminQueryType_ALL == aqQuery.aqtType) ? plt->dwSlotCount : 1;
+		DWORD dwTotalLeases = 0;
+		bool bBusy = false;
+		for (DWORD dwFirstSlot = 0; (dwFirstSlot < dwSlotCount) && !bBusy && !pao->bFailed; dwFirstSlot += SNAPSHOT_CHUNK_SLOTS)
+		{
+			DWORD dwLeases;
+			if (SnapshotLeases(plt, &aqQuery, dwFirstSlot, paiuiLeases, ARRAY_LENGTH(paiuiLeases), &dwLeases))
+			{
+				for (DWORD i = 0; (i < dwLeases) && !pao->bFailed; i++)
+				{
+					AdminOutputLease(pao, &(paiuiLeases[i]));
+				}
+				dwTotalLeases += dwLeases;
+			}
+			else
+			{
+				bBusy = true;
+			}
+		}
+		if (!bBusy)
+		{
+			AdminOutputLine(pao, "%u lease(s)", dwTotalLeases);
+		}
+		else
+		{
+			AdminOutputLine(pao, "ERROR: Lease table is busy; try again.");
+		}
+	}
+	else
+	{
+		AdminOutputLine(pao, "ERROR: Unknown or invalid request.");
+		AdminOutputLine(pao, "Usage: dump | ip <a.b.c.d> | mac <xx-xx-xx-xx-xx-xx> | client <hex> | host <name> | trace | reload [status]");
+	}
+}
+
+bool ReadAdminRequest(const HANDLE hPipe, char* const pcsRequest, const size_t stRequestLength)
+{
+	ASSERT((INVALID_HANDLE_VALUE != hPipe) && (0 != pcsRequest) && (1 <= stRequestLength));
+	// Requests are terminated by a newline (or by the client closing its end)
+	size_t stRead = 0;
+	bool bComplete = false;
+	while (!bComplete && (stRead < stRequestLength - 1))
+	{
+		DWORD dwBytesRead;
+		if (ReadFile(hPipe, pcsRequest + stRead, (DWORD)(stRequestLength - 1 - stRead), &dwBytesRead, 0) && (0 != dwBytesRead))
+		{
+			stRead += dwBytesRead;
+			bComplete = (0 != memchr(pcsRequest, '\n', stRead));
+		}
+		else
+		{
+			bComplete = true;
+		}
+	}
+	pcsRequest[stRead] = '\0';
+	pcsRequest[strcspn(pcsRequest, "\r\n")] = '\0';
+	return ('\0' != pcsRequest[0]);
+}
+
+struct AdminThreadData
+{
+	DHCPEngine* pde;
+	const ServerConfigurationSource* pscs;
+	FlightRecorder* pfr;
+	volatile LONG lStopping;
+	HANDLE hThread;
+};
+
+DWORD WINAPI AdminThreadProc(LPVOID pvParameter)
+{
+	AdminThreadData* const patd = (AdminThreadData*)pvParameter;
+	ASSERT(0 != patd);
+	bool bPipeAvailable = true;
+	while (bPipeAvailable && !patd->lStopping)
+	{
+		// No lease table or configuration is referenced between requests
+		FreeRetiredDHCPEngineStates(patd->pde);
+		const HANDLE hPipe = CreateNamedPipe(ptsAdminPipeName, PIPE_ACCESS_DUPLEX, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+			1, ADMIN_OUTPUT_BUFFER_SIZE, MAX_ADMIN_REQUEST_LENGTH, 0, 0);
+		if (INVALID_HANDLE_VALUE != hPipe)
+		{
+			if ((ConnectNamedPipe(hPipe, 0) || (ERROR_PIPE_CONNECTED == GetLastError())) && !patd->lStopping)
+			{
+				char pcsRequest[MAX_ADMIN_REQUEST_LENGTH];
+				if (ReadAdminRequest(hPipe, pcsRequest, ARRAY_LENGTH(pcsRequest)))
+				{
+					AdminOutput aoOutput;
+					aoOutput.hPipe = hPipe;
+					aoOutput.bFailed = false;
+					aoOutput.stBufferUsed = 0;
+					ProcessAdminRequest(&aoOutput, patd->pde, patd->pscs, patd->pfr, pcsRequest);
+					FlushAdminOutput(&aoOutput);
+					FlushFileBuffers(hPipe);  // Fails harmlessly if the client has already gone away
+				}
+				DisconnectNamedPipe(hPipe);
+			}
+			VERIFY(CloseHandle(hPipe));
+		}
+		else
+		{
+			OUTPUT_ERROR((TEXT("Unable to create admin pipe (error %d)."), GetLastError()));
+			bPipeAvailable = false;
+		}
+	}
+	return 0;
+}
+
+bool StartAdminThread(AdminThreadData* const patd, DHCPEngine* const pde, const ServerConfigurationSource* const pscs, FlightRecorder* const pfr)
+{
+	ASSERT((0 != patd) && (0 != pde) && (0 != pscs) && (0 != pfr));
+	patd->pde = pde;
+	patd->pscs = pscs;
+	patd->pfr = pfr;
+	patd->lStopping = FALSE;
+	patd->hThread = CreateThread(0, 0, AdminThreadProc, patd, 0, 0);
+	if (0 == patd->hThread)
+	{
+		OUTPUT_ERROR((TEXT("Unable to start admin thread; admin queries are unavailable.")));
+	}
+	return (0 != patd->hThread);
+}
+
+void StopAdminThread(AdminThreadData* const patd)
+{
+	ASSERT((0 != patd) && (0 != patd->hThread));
+	InterlockedExchange(&(patd->lStopping), TRUE);
+	// Repeat in case the thread was between blocking calls the first time
+	do
+	{
+		CancelSynchronousIo(patd->hThread);
+	} while (WAIT_TIMEOUT == WaitForSingleObject(patd->hThread, 100));
+	VERIFY(CloseHandle(patd->hThread));
+	patd->hThread = 0;
+}
+
+SOCKET sServerSocket = INVALID_SOCKET;  // Global to allow ConsoleCtrlHandlerRoutine access to it
+FlightRecorder frFlightRecorder;  // Global to allow ConsoleCtrlHandlerRoutine access to it
+const TCHAR ptsFlightRecorderFileName[] = TEXT("DHCPLite.trace");
+
+void SaveFlightRecorder(FlightRecorder* const pfr, const TCHAR* const ptsFileName)
+{
+	ASSERT((0 != pfr) && (0 != ptsFileName));
+	const HANDLE hFile = CreateFile(ptsFileName, GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+	if (INVALID_HANDLE_VALUE != hFile)
+	{
+		if (WriteFlightRecorder(pfr, hFile))
+		{
+			OUTPUT((TEXT("Flight recorder saved to \"%s\"."), ptsFileName));
+		}
+		else
+		{
+			OUTPUT_ERROR((TEXT("Unable to write flight recorder file \"%s\"."), ptsFileName));
+		}
+		VERIFY(CloseHandle(hFile));
+	}
+	else
+	{
+		OUTPUT_ERROR((TEXT("Unable to create flight recorder file \"%s\"."), ptsFileName));
+	}
+}
+
+BOOL WINAPI ConsoleCtrlHandlerRoutine(DWORD dwCtrlType)
+{
+	BOOL bReturn = FALSE;
+	if (CTRL_C_EVENT == dwCtrlType)
+	{
+		if (INVALID_SOCKET != sServerSocket)
+		{
+			VERIFY(0 == closesocket(sServerSocket));
+			sServerSocket = INVALID_SOCKET;
+		}
+		bReturn = TRUE;
+	}
+	else if (CTRL_BREAK_EVENT == dwCtrlType)
+	{
+		SaveFlightRecorder(&frFlightRecorder, ptsFlightRecorderFileName);
+		bReturn = TRUE;
+	}
+	return bReturn;
+}
+
+struct CommandLineArguments
+{
+	ServerConfigurationSource scsConfiguration;
+	const char* pcsDecodeFileName;  // Decode a flight recorder file instead of running the server
+};
+
+bool ParseArguments(const int argc, char** const argv, CommandLineArguments* const pclaArguments)
+{
+	ASSERT((0 != argv) && (0 != pclaArguments));
+	bool bSuccess = true;
+	pclaArguments->scsConfiguration.pcsFileName[0] = '\0';
+	pclaArguments->scsConfiguration.aamDefaultMode = AddressAssignmentMode_NEXTFIT;
+	pclaArguments->pcsDecodeFileName = 0;
+	for (int i = 1; bSuccess && (i < argc); i++)
+	{
+		if ((0 == _stricmp(argv[i], "/hash")) || (0 == _stricmp(argv[i], "-hash")))
+		{
+			pclaArguments->scsConfiguration.aamDefaultMode = AddressAssignmentMode_HASH;
+		}
+		else if (((0 == _stricmp(argv[i], "/config")) || (0 == _stricmp(argv[i], "-config"))) && (i + 1 < argc))
+		{
+			i++;
+			// Profile APIs look in the Windows directory for relative paths
+			const DWORD dwLength = GetFullPathName(argv[i], ARRAY_LENGTH(pclaArguments->scsConfiguration.pcsFileName), pclaArguments->scsConfiguration.pcsFileName, 0);
+			if ((0 == dwLength) || (ARRAY_LENGTH(pclaArguments->scsConfiguration.pcsFileName) <= dwLength))
+			{
+				OUTPUT_ERROR((TEXT("Invalid configuration file name \"%s\"."), argv[i]));
+				bSuccess = false;
+			}
+		}
+		else if (((0 == _stricmp(argv[i], "/decode")) || (0 == _stricmp(argv[i], "-decode"))) && (i + 1 < argc))
+		{
+			i++;
+			pclaArguments->pcsDecodeFileName = argv[i];
+		}
+		else
+		{
+			OUTPUT_ERROR((TEXT("Unknown argument \"%s\"."), argv[i]));
+			OUTPUT_ERROR((TEXT("[Usage: DHCPLite [/hash] [/config <file>] | DHCPLite /decode <file>]")));
+			bSuccess = false;
+		}
+	}
+	return bSuccess;
+}
+
+// DHCPLiteTests includes this file to test its internals and has its own main
+#if !defined(DHCPLITE_TESTS)
+int main(int argc, char** argv)
+{
+	OUTPUT((TEXT("")));
+	OUTPUT((TEXT("DHCPLite")));
+	OUTPUT((TEXT("2016-04-02")));
+	OUTPUT((TEXT("Copyright (c) 2001-2016 by David Anson (http://dlaa.me/)")));
+	OUTPUT((TEXT("")));
+	CommandLineArguments claArguments;
+	if (ParseArguments(argc, argv, &claArguments))
+	{
+		if (0 != claArguments.pcsDecodeFileName)
+		{
+			VERIFY(DecodeFlightRecorderFile(claArguments.pcsDecodeFileName));
+		}
+		else if (SetConsoleCtrlHandler(ConsoleCtrlHandlerRoutine, TRUE))
+		{
+			InitializeFlightRecorder(&frFlightRecorder);
+			ServerConfiguration scConfiguration;
+			DynamicDNSConfiguration ddcDynamicDNS;
+			if (LoadServerConfiguration(&scConfiguration, &(claArguments.scsConfiguration)) && LoadDynamicDNSConfiguration(&ddcDynamicDNS, &(claArguments.scsConfiguration)))
+			{
+				WSADATA wsaData;
 				if (0 == WSAStartup(MAKEWORD(1, 1), &wsaData))
 				{
-					OUTPUT((TEXT("")));
-					OUTPUT((TEXT("Server is running...  (Press Ctrl+C to shutdown.)")));
-					OUTPUT((TEXT("")));
 					char pcsServerHostName[MAX_HOSTNAME_LENGTH];
-					if (InitializeDHCPServer(&sServerSocket, dwServerAddr, pcsServerHostName, ARRAY_LENGTH(pcsServerHostName)))
+					if (InitializeDHCPServer(&sServerSocket, scConfiguration.dwServerAddr, pcsServerHostName, ARRAY_LENGTH(pcsServerHostName)))
 					{
-						VERIFY(ReadDHCPClientRequests(sServerSocket, pcsServerHostName, &vAddressesInUse, dwServerAddr, dwMask, dwMinAddr, dwMaxAddr));
+						DynamicDNSUpdater dduDynamicDNS;
+						const bool bDynamicDNSStarted = (0 != ddcDynamicDNS.dwServerAddr) && StartDynamicDNSUpdater(&dduDynamicDNS, &ddcDynamicDNS);
+						DHCPEngine deEngine;
+						if (InitializeDHCPEngine(&deEngine, &scConfiguration, pcsServerHostName, HandleDHCPEngineEvent, bDynamicDNSStarted ? &dduDynamicDNS : 0))
+						{
+							OUTPUT((TEXT("")));
+							OUTPUT((TEXT("Server is running...  (Press Ctrl+C to shutdown or Ctrl+Break to save the flight recorder.)")));
+							OUTPUT((TEXT("")));
+							AdminThreadData atdAdmin;
+							const bool bAdminThreadStarted = StartAdminThread(&atdAdmin, &deEngine, &(claArguments.scsConfiguration), &frFlightRecorder);
+							VERIFY(ReadDHCPClientRequests(sServerSocket, &deEngine, &frFlightRecorder));
+							if (bAdminThreadStarted)
+							{
+								StopAdminThread(&atdAdmin);
+							}
+						}
+						else
+						{
+							OUTPUT_ERROR((TEXT("Insufficient memory for lease table.")));
+						}
 						if (INVALID_SOCKET != sServerSocket)
 						{
 							VERIFY(0 == closesocket(sServerSocket));
 							sServerSocket = INVALID_SOCKET;
 						}
+						if (bDynamicDNSStarted)
+						{
+							StopDynamicDNSUpdater(&dduDynamicDNS);
+						}
+						// All threads have stopped
+						FreeDHCPEngine(&deEngine);
 					}
 					else
 					{
@@ -791,25 +1949,18 @@ int main(int /*argc*/, char** /*argv*/)
 			}
 			else
 			{
-				OUTPUT_ERROR((TEXT("Insufficient memory to add server address.")));
-			}
-			for (size_t i = 0; i < vAddressesInUse.size(); i++)
-			{
-				aiuiServerAddress = vAddressesInUse.at(i);
-				if (0 != aiuiServerAddress.pbClientIdentifier)
-				{
-					VERIFY(0 == LocalFree(aiuiServerAddress.pbClientIdentifier));
-				}
+				// OUTPUT_ERROR called by LoadServerConfiguration
 			}
 		}
 		else
 		{
-			// OUTPUT_ERROR called by GetIPAddressInformation
+			OUTPUT_ERROR((TEXT("Unable to set Ctrl-C handler.")));
 		}
 	}
 	else
 	{
-		OUTPUT_ERROR((TEXT("Unable to set Ctrl-C handler.")));
+		// OUTPUT_ERROR called by ParseArguments
 	}
 	return 0;
 }
+#endif  // !defined(DHCPLITE_TESTS)
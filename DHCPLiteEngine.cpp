@@ -0,0 +1,1325 @@
+#include "toolbox.h"
+#include "DHCPLiteEngine.h"
+
+// Addresses are in network order; lease table values are in host order
+#define DWIP0(dw) (((dw)>> 0) & 0xff)
+#define DWIP1(dw) (((dw)>> 8) & 0xff)
+#define DWIP2(dw) (((dw)>>16) & 0xff)
+#define DWIP3(dw) (((dw)>>24) & 0xff)
+#define DWIPtoValue(dw) ((DWIP0(dw)<<24) | (DWIP1(dw)<<16) | (DWIP2(dw)<<8) | DWIP3(dw))
+#define DWValuetoIP(dw) ((DWIP0(dw)<<24) | (DWIP1(dw)<<16) | (DWIP2(dw)<<8) | DWIP3(dw))
+
+const char pcsServerName[] = "DHCPLite DHCP server";
+
+// Broadcast bit for flags field (RFC 2131 section 2)
+#define BROADCAST_FLAG (0x80)
+// RFC 2131 section 2
+enum op_values
+{
+	op_BOOTREQUEST = 1,
+	op_BOOTREPLY = 2,
+};
+// RFC 2132 section 9.6
+enum option_values
+{
+	option_PAD = 0,
+	option_SUBNETMASK = 1,
+	option_HOSTNAME = 12,
+	option_REQUESTEDIPADDRESS = 50,
+	option_IPADDRESSLEASETIME = 51,
+	option_DHCPMESSAGETYPE = 53,
+	option_SERVERIDENTIFIER = 54,
+	option_RENEWALTIME = 58,
+	option_REBINDINGTIME = 59,
+	option_CLIENTIDENTIFIER = 61,
+	option_END = 255,
+};
+
+// DHCP magic cookie values
+const BYTE pbDHCPMagicCookie[] = { 99, 130, 83, 99 };
+
+const char* const ppcsLeaseStateNames[] =
+{
+	"free",
+	"reserved",
+	"offered",
+	"bound",
+	"released",
+};
+C_ASSERT(LeaseState_COUNT == ARRAY_LENGTH(ppcsLeaseStateNames));
+
+// FNV-1a
+#define FNV_OFFSET_BASIS (2166136261)
+#define FNV_PRIME (16777619)
+DWORD StoredClientIdentifierSize(const DWORD dwClientIdentifierSize)
+{
+	return min(dwClientIdentifierSize, (DWORD)MAX_STORED_CLIENT_IDENTIFIER_LENGTH);
+}
+DWORD HashClientIdentifier(const BYTE* const pbClientIdentifier, const DWORD dwClientIdentifierSize)
+{
+	DWORD dwHash = FNV_OFFSET_BASIS ^ dwClientIdentifierSize;
+	const DWORD dwStoredSize = StoredClientIdentifierSize(dwClientIdentifierSize);
+	for (DWORD i = 0; i < dwStoredSize; i++)
+	{
+		dwHash = (dwHash ^ pbClientIdentifier[i]) * FNV_PRIME;
+	}
+	return dwHash;
+}
+// FNV-1a (64-bit) over the whole client identifier
+ULONGLONG HashClientIdentifier64(const BYTE* const pbClientIdentifier, const DWORD dwClientIdentifierSize)
+{
+	ULONGLONG qwHash = 14695981039346656037ULL;
+	for (DWORD i = 0; i < dwClientIdentifierSize; i++)
+	{
+		qwHash = (qwHash ^ pbClientIdentifier[i]) * 1099511628211ULL;
+	}
+	return qwHash;
+}
+DWORD HashHostName(const char* const pcsHostName)
+{
+	DWORD dwHash = FNV_OFFSET_BASIS;
+	for (size_t i = 0; (i < MAX_STORED_HOSTNAME_LENGTH) && ('\0' != pcsHostName[i]); i++)
+	{
+		dwHash = (dwHash ^ (BYTE)tolower((BYTE)pcsHostName[i])) * FNV_PRIME;  // Host names compare case-insensitively
+	}
+	return dwHash;
+}
+
+void FreeLeaseTable(LeaseTable* const plt)
+{
+	ASSERT(0 != plt);
+	if (0 != plt->paiuiSlots)
+	{
+		VERIFY(0 == LocalFree(plt->paiuiSlots));
+	}
+	if (0 != plt->piClientIdentifierBuckets)
+	{
+		VERIFY(0 == LocalFree(plt->piClientIdentifierBuckets));
+	}
+	if (0 != plt->piHostNameBuckets)
+	{
+		VERIFY(0 == LocalFree(plt->piHostNameBuckets));
+	}
+	ZeroMemory(plt, sizeof(*plt));
+}
+
+bool InitializeLeaseTable(LeaseTable* const plt, const DWORD dwMinAddrValue, const DWORD dwMaxAddrValue)
+{
+	ASSERT((0 != plt) && (dwMinAddrValue <= dwMaxAddrValue) && (dwMaxAddrValue - dwMinAddrValue < MAX_LEASE_TABLE_SIZE));
+	bool bSuccess = false;
+	ZeroMemory(plt, sizeof(*plt));
+	const DWORD dwSlotCount = dwMaxAddrValue - dwMinAddrValue + 1;
+	DWORD dwBucketCount = 1;
+	while (dwBucketCount < dwSlotCount)
+	{
+		dwBucketCount <<= 1;
+	}
+	plt->paiuiSlots = (AddressInUseInformation*)LocalAlloc(LMEM_FIXED, dwSlotCount * sizeof(AddressInUseInformation));
+	plt->piClientIdentifierBuckets = (int*)LocalAlloc(LMEM_FIXED, dwBucketCount * sizeof(int));
+	plt->piHostNameBuckets = (int*)LocalAlloc(LMEM_FIXED, dwBucketCount * sizeof(int));
+	if ((0 != plt->paiuiSlots) && (0 != plt->piClientIdentifierBuckets) && (0 != plt->piHostNameBuckets))
+	{
+		ZeroMemory(plt->paiuiSlots, dwSlotCount * sizeof(AddressInUseInformation));
+		for (DWORD i = 0; i < dwSlotCount; i++)
+		{
+			plt->paiuiSlots[i].dwAddrValue = dwMinAddrValue + i;
+			plt->paiuiSlots[i].iNextClientIdentifierIndex = -1;
+			plt->paiuiSlots[i].iNextHostNameIndex = -1;
+			plt->paiuiSlots[i].iOlderOfferIndex = -1;
+			plt->paiuiSlots[i].iNewerOfferIndex = -1;
+		}
+		for (DWORD i = 0; i < dwBucketCount; i++)
+		{
+			plt->piClientIdentifierBuckets[i] = -1;
+			plt->piHostNameBuckets[i] = -1;
+		}
+		plt->dwMinAddrValue = dwMinAddrValue;
+		plt->dwSlotCount = dwSlotCount;
+		plt->dwBucketMask = dwBucketCount - 1;
+		plt->dwLastOfferAddrValue = dwMaxAddrValue;  // Initialize to max to wrap and offer min first
+		plt->iOldestOfferIndex = -1;
+		plt->iNewestOfferIndex = -1;
+		bSuccess = true;
+	}
+	else
+	{
+		FreeLeaseTable(plt);
+	}
+	return bSuccess;
+}
+
+void BeginLeaseTableUpdate(LeaseTable* const plt)
+{
+	VERIFY(1 == (InterlockedIncrement(&(plt->lSequence)) & 1));
+}
+void EndLeaseTableUpdate(LeaseTable* const plt)
+{
+	VERIFY(0 == (InterlockedIncrement(&(plt->lSequence)) & 1));
+}
+
+// The Find* functions are also called by seqlock readers that may observe a
+// partial update, so indexes are validated and chain walks are bounded
+int FindLeaseTableIndexOfAddress(const LeaseTable* const plt, const DWORD dwAddrValue)
+{
+	ASSERT(0 != plt);
+	const DWORD dwOffset = dwAddrValue - plt->dwMinAddrValue;
+	return (dwOffset < plt->dwSlotCount) ? (int)dwOffset : -1;
+}
+
+// pbClientIdentifier may be a stored prefix; qwClientIdentifierHash always covers the whole identifier
+int FindLeaseTableIndexOfClientIdentifierHash(const LeaseTable* const plt, const BYTE* const pbClientIdentifier, const DWORD dwClientIdentifierSize, const ULONGLONG qwClientIdentifierHash)
+{
+	ASSERT((0 != plt) && (0 != pbClientIdentifier) && (0 != dwClientIdentifierSize));
+	int iIndex = plt->piClientIdentifierBuckets[HashClientIdentifier(pbClientIdentifier, dwClientIdentifierSize) & plt->dwBucketMask];
+	for (DWORD dwSteps = 0; (0 <= iIndex) && ((DWORD)iIndex < plt->dwSlotCount) && (dwSteps < plt->dwSlotCount); dwSteps++)
+	{
+		const AddressInUseInformation& raiui = plt->paiuiSlots[iIndex];
+		if ((LeaseState_FREE != raiui.lsState) && (dwClientIdentifierSize == raiui.dwClientIdentifierSize) && (qwClientIdentifierHash == raiui.qwClientIdentifierHash) &&
+			(0 == memcmp(pbClientIdentifier, raiui.pbClientIdentifier, StoredClientIdentifierSize(dwClientIdentifierSize))))
+		{
+			return iIndex;
+		}
+		iIndex = raiui.iNextClientIdentifierIndex;
+	}
+	return -1;
+}
+int FindLeaseTableIndexOfClientIdentifier(const LeaseTable* const plt, const BYTE* const pbClientIdentifier, const DWORD dwClientIdentifierSize)
+{
+	return FindLeaseTableIndexOfClientIdentifierHash(plt, pbClientIdentifier, dwClientIdentifierSize, HashClientIdentifier64(pbClientIdentifier, dwClientIdentifierSize));
+}
+
+DWORD FindLeaseTableIndexesOfHostName(const LeaseTable* const plt, const char* const pcsHostName, int* const piIndexes, const DWORD dwMaxIndexes)
+{
+	ASSERT((0 != plt) && (0 != pcsHostName) && (0 != piIndexes));
+	DWORD dwIndexes = 0;
+	int iIndex = plt->piHostNameBuckets[HashHostName(pcsHostName) & plt->dwBucketMask];
+	for (DWORD dwSteps = 0; (0 <= iIndex) && ((DWORD)iIndex < plt->dwSlotCount) && (dwSteps < plt->dwSlotCount) && (dwIndexes < dwMaxIndexes); dwSteps++)
+	{
+		const AddressInUseInformation& raiui = plt->paiuiSlots[iIndex];
+		if ((LeaseState_FREE != raiui.lsState) && (0 == _strnicmp(pcsHostName, raiui.pcsHostName, MAX_STORED_HOSTNAME_LENGTH - 1)))
+		{
+			piIndexes[dwIndexes++] = iIndex;
+		}
+		iIndex = raiui.iNextHostNameIndex;
+	}
+	return dwIndexes;
+}
+
+void SetLeaseTableHostName(LeaseTable* const plt, const int iIndex, const char* const pcsHostName)
+{
+	ASSERT((0 != plt) && (0 <= iIndex) && ((DWORD)iIndex < plt->dwSlotCount) && (0 != pcsHostName) && (1 == (plt->lSequence & 1)));
+	AddressInUseInformation* const paiui = &(plt->paiuiSlots[iIndex]);
+	if ('\0' != paiui->pcsHostName[0])
+	{
+		int* piLink = &(plt->piHostNameBuckets[HashHostName(paiui->pcsHostName) & plt->dwBucketMask]);
+		while (iIndex != *piLink)
+		{
+			ASSERT(-1 != *piLink);
+			piLink = &(plt->paiuiSlots[*piLink].iNextHostNameIndex);
+		}
+		*piLink = paiui->iNextHostNameIndex;
+		paiui->iNextHostNameIndex = -1;
+	}
+	strncpy_s(paiui->pcsHostName, sizeof(paiui->pcsHostName), pcsHostName, _TRUNCATE);
+	if ('\0' != paiui->pcsHostName[0])
+	{
+		int* const piBucket = &(plt->piHostNameBuckets[HashHostName(paiui->pcsHostName) & plt->dwBucketMask]);
+		paiui->iNextHostNameIndex = *piBucket;
+		*piBucket = iIndex;
+	}
+}
+
+bool AddLeaseWithClientIdentifierHash(LeaseTable* const plt, const DWORD dwAddrValue, const BYTE* const pbClientIdentifier, const DWORD dwClientIdentifierSize, const ULONGLONG qwClientIdentifierHash, const char* const pcsHostName, const LeaseStates lsState)
+{
+	ASSERT((0 != plt) && ((0 == dwClientIdentifierSize) || (0 != pbClientIdentifier)) && (0 != pcsHostName) && (LeaseState_FREE != lsState));
+	bool bSuccess = false;
+	const int iIndex = FindLeaseTableIndexOfAddress(plt, dwAddrValue);
+	if (-1 != iIndex)
+	{
+		AddressInUseInformation* const paiui = &(plt->paiuiSlots[iIndex]);
+		ASSERT(LeaseState_FREE == paiui->lsState);
+		BeginLeaseTableUpdate(plt);
+		paiui->dwClientIdentifierSize = dwClientIdentifierSize;
+		paiui->qwClientIdentifierHash = qwClientIdentifierHash;
+		if (0 != dwClientIdentifierSize)
+		{
+			CopyMemory(paiui->pbClientIdentifier, pbClientIdentifier, StoredClientIdentifierSize(dwClientIdentifierSize));
+			int* const piBucket = &(plt->piClientIdentifierBuckets[HashClientIdentifier(pbClientIdentifier, dwClientIdentifierSize) & plt->dwBucketMask]);
+			paiui->iNextClientIdentifierIndex = *piBucket;
+			*piBucket = iIndex;
+		}
+		SetLeaseTableHostName(plt, iIndex, pcsHostName);
+		paiui->lsState = lsState;
+		EndLeaseTableUpdate(plt);
+		bSuccess = true;
+	}
+	return bSuccess;
+}
+bool AddLease(LeaseTable* const plt, const DWORD dwAddrValue, const BYTE* const pbClientIdentifier, const DWORD dwClientIdentifierSize, const char* const pcsHostName, const LeaseStates lsState)
+{
+	return AddLeaseWithClientIdentifierHash(plt, dwAddrValue, pbClientIdentifier, dwClientIdentifierSize, HashClientIdentifier64(pbClientIdentifier, dwClientIdentifierSize), pcsHostName, lsState);
+}
+
+void RemoveLease(LeaseTable* const plt, const int iIndex)
+{
+	ASSERT((0 != plt) && (0 <= iIndex) && ((DWORD)iIndex < plt->dwSlotCount));
+	AddressInUseInformation* const paiui = &(plt->paiuiSlots[iIndex]);
+	ASSERT((LeaseState_FREE != paiui->lsState) && (0 != paiui->dwClientIdentifierSize));
+	ASSERT((-1 == paiui->iOlderOfferIndex) && (-1 == paiui->iNewerOfferIndex) && (iIndex != plt->iOldestOfferIndex));  // Offers leave the expiry queue first
+	BeginLeaseTableUpdate(plt);
+	int* piLink = &(plt->piClientIdentifierBuckets[HashClientIdentifier(paiui->pbClientIdentifier, paiui->dwClientIdentifierSize) & plt->dwBucketMask]);
+	while (iIndex != *piLink)
+	{
+		ASSERT(-1 != *piLink);
+		piLink = &(plt->paiuiSlots[*piLink].iNextClientIdentifierIndex);
+	}
+	*piLink = paiui->iNextClientIdentifierIndex;
+	paiui->iNextClientIdentifierIndex = -1;
+	paiui->dwClientIdentifierSize = 0;
+	paiui->qwClientIdentifierHash = 0;
+	SetLeaseTableHostName(plt, iIndex, "");
+	paiui->lsState = LeaseState_FREE;
+	EndLeaseTableUpdate(plt);
+}
+
+void SetLeaseState(LeaseTable* const plt, const int iIndex, const LeaseStates lsState)
+{
+	ASSERT((0 != plt) && (0 <= iIndex) && ((DWORD)iIndex < plt->dwSlotCount) && (LeaseState_FREE != lsState));
+	// Renewals leave a bound lease bound; only real changes make readers retry
+	if (lsState != plt->paiuiSlots[iIndex].lsState)
+	{
+		BeginLeaseTableUpdate(plt);
+		plt->paiuiSlots[iIndex].lsState = lsState;
+		EndLeaseTableUpdate(plt);
+	}
+}
+
+// The offer expiry queue is only used by the packet thread (so it needs no seqlock)
+void AppendOfferExpiry(LeaseTable* const plt, const int iIndex, const ULONGLONG qwExpireTime)
+{
+	ASSERT((0 != plt) && (0 <= iIndex) && ((DWORD)iIndex < plt->dwSlotCount) && (LeaseState_OFFERED == plt->paiuiSlots[iIndex].lsState));
+	AddressInUseInformation* const paiui = &(plt->paiuiSlots[iIndex]);
+	ASSERT((-1 == paiui->iOlderOfferIndex) && (-1 == paiui->iNewerOfferIndex) && (iIndex != plt->iOldestOfferIndex));
+	ASSERT((-1 == plt->iNewestOfferIndex) || (plt->paiuiSlots[plt->iNewestOfferIndex].qwOfferExpireTime <= qwExpireTime));
+	paiui->qwOfferExpireTime = qwExpireTime;
+	paiui->iOlderOfferIndex = plt->iNewestOfferIndex;
+	if (-1 != plt->iNewestOfferIndex)
+	{
+		plt->paiuiSlots[plt->iNewestOfferIndex].iNewerOfferIndex = iIndex;
+	}
+	else
+	{
+		plt->iOldestOfferIndex = iIndex;
+	}
+	plt->iNewestOfferIndex = iIndex;
+}
+
+void UnlinkOfferExpiry(LeaseTable* const plt, const int iIndex)
+{
+	ASSERT((0 != plt) && (0 <= iIndex) && ((DWORD)iIndex < plt->dwSlotCount) && (LeaseState_OFFERED == plt->paiuiSlots[iIndex].lsState));
+	AddressInUseInformation* const paiui = &(plt->paiuiSlots[iIndex]);
+	if (-1 != paiui->iOlderOfferIndex)
+	{
+		plt->paiuiSlots[paiui->iOlderOfferIndex].iNewerOfferIndex = paiui->iNewerOfferIndex;
+	}
+	else
+	{
+		ASSERT(iIndex == plt->iOldestOfferIndex);
+		plt->iOldestOfferIndex = paiui->iNewerOfferIndex;
+	}
+	if (-1 != paiui->iNewerOfferIndex)
+	{
+		plt->paiuiSlots[paiui->iNewerOfferIndex].iOlderOfferIndex = paiui->iOlderOfferIndex;
+	}
+	else
+	{
+		ASSERT(iIndex == plt->iNewestOfferIndex);
+		plt->iNewestOfferIndex = paiui->iOlderOfferIndex;
+	}
+	paiui->iOlderOfferIndex = -1;
+	paiui->iNewerOfferIndex = -1;
+}
+
+// Returns the number of offers that expired
+DWORD ExpireOffers(LeaseTable* const plt, const ULONGLONG qwNow)
+{
+	ASSERT(0 != plt);
+	DWORD dwExpired = 0;
+	while ((-1 != plt->iOldestOfferIndex) && (plt->paiuiSlots[plt->iOldestOfferIndex].qwOfferExpireTime <= qwNow))
+	{
+		const int iIndex = plt->iOldestOfferIndex;
+		UnlinkOfferExpiry(plt, iIndex);
+		RemoveLease(plt, iIndex);
+		dwExpired++;
+	}
+	return dwExpired;
+}
+
+// Returns true if the name changed
+bool UpdateLeaseHostName(LeaseTable* const plt, const int iIndex, const char* const pcsHostName)
+{
+	ASSERT((0 != plt) && (0 <= iIndex) && ((DWORD)iIndex < plt->dwSlotCount) && (0 != pcsHostName));
+	// Keep the previous name if the client didn't send one
+	const bool bChanged = ('\0' != pcsHostName[0]) && (0 != strncmp(pcsHostName, plt->paiuiSlots[iIndex].pcsHostName, MAX_STORED_HOSTNAME_LENGTH - 1));
+	if (bChanged)
+	{
+		BeginLeaseTableUpdate(plt);
+		SetLeaseTableHostName(plt, iIndex, pcsHostName);
+		EndLeaseTableUpdate(plt);
+	}
+	return bChanged;
+}
+
+// Addresses tried after the hashed address before falling back to next-fit
+#define MAX_HASH_PROBES (16)
+
+// "A Fast, Minimal Memory, Consistent Hash Algorithm" (Lamping and Veach) - when
+// the number of buckets changes, only the keys that must move are remapped
+DWORD JumpConsistentHash(ULONGLONG qwKey, const DWORD dwBuckets)
+{
+	ASSERT(0 != dwBuckets);
+	LONGLONG llBucket = -1;
+	LONGLONG llJump = 0;
+	while (llJump < (LONGLONG)dwBuckets)
+	{
+		llBucket = llJump;
+		qwKey = (qwKey * 2862933555777941757ULL) + 1;
+		llJump = (LONGLONG)((llBucket + 1) * ((double)(1LL << 31) / (double)((qwKey >> 33) + 1)));
+	}
+	return (DWORD)llBucket;
+}
+
+int FindHashedLeaseTableIndex(const LeaseTable* const plt, const BYTE* const pbClientIdentifier, const DWORD dwClientIdentifierSize)
+{
+	ASSERT((0 != plt) && (0 != pbClientIdentifier) && (0 != dwClientIdentifierSize));
+	// Linear probing from the preferred address so collisions stay near it
+	const DWORD dwPreferredIndex = JumpConsistentHash(HashClientIdentifier64(pbClientIdentifier, dwClientIdentifierSize), plt->dwSlotCount);
+	const DWORD dwProbes = min((DWORD)MAX_HASH_PROBES, plt->dwSlotCount);
+	for (DWORD i = 0; i < dwProbes; i++)
+	{
+		const DWORD dwIndex = (dwPreferredIndex + i) % plt->dwSlotCount;
+		if (LeaseState_FREE == plt->paiuiSlots[dwIndex].lsState)
+		{
+			return (int)dwIndex;
+		}
+	}
+	return -1;
+}
+
+// Server options are laid out at compile time: each reply shape lists its
+// options in order, so every offset (and the total size) is a constant and
+// writing a reply is a few fixed-offset stores with no PAD filler
+template <BYTE bCode, BYTE bDataSize>
+struct DHCPOption
+{
+	enum { Code = bCode, DataSize = bDataSize, Size = 2 + bDataSize };
+};
+// RFC 2132 section 9.6
+typedef DHCPOption<option_DHCPMESSAGETYPE, 1> DHCPMessageTypeOption;
+// RFC 2132 section 9.2
+typedef DHCPOption<option_IPADDRESSLEASETIME, 4> DHCPLeaseTimeOption;
+// RFC 2132 section 3.3
+typedef DHCPOption<option_SUBNETMASK, 4> DHCPSubnetMaskOption;
+// RFC 2132 section 9.7
+typedef DHCPOption<option_SERVERIDENTIFIER, 4> DHCPServerIdentifierOption;
+// RFC 2132 section 9.11
+typedef DHCPOption<option_RENEWALTIME, 4> DHCPRenewalTimeOption;
+// RFC 2132 section 9.12
+typedef DHCPOption<option_REBINDINGTIME, 4> DHCPRebindingTimeOption;
+
+template <typename... TOptions>
+struct DHCPOptionHeaders;
+template <>
+struct DHCPOptionHeaders<>
+{
+	enum { Size = 1 };
+	static void Write(BYTE* const pbOptions)
+	{
+		pbOptions[0] = option_END;
+	}
+};
+template <typename TFirst, typename... TRest>
+struct DHCPOptionHeaders<TFirst, TRest...>
+{
+	enum { Size = TFirst::Size + DHCPOptionHeaders<TRest...>::Size };
+	static void Write(BYTE* const pbOptions)
+	{
+		pbOptions[0] = TFirst::Code;
+		pbOptions[1] = TFirst::DataSize;
+		DHCPOptionHeaders<TRest...>::Write(pbOptions + TFirst::Size);
+	}
+};
+
+// Not defined for options missing from the layout (so misuse fails to compile)
+template <typename TOption, typename... TOptions>
+struct DHCPOptionOffset;
+template <typename TOption, typename... TRest>
+struct DHCPOptionOffset<TOption, TOption, TRest...>
+{
+	enum { Value = 0 };
+};
+template <typename TOption, typename TFirst, typename... TRest>
+struct DHCPOptionOffset<TOption, TFirst, TRest...>
+{
+	enum { Value = TFirst::Size + DHCPOptionOffset<TOption, TRest...>::Value };
+};
+
+template <typename... TOptions>
+struct DHCPOptionLayout
+{
+	// Magic cookie, options, then END (RFC 2131 section 3)
+	enum { Size = sizeof(pbDHCPMagicCookie) + DHCPOptionHeaders<TOptions...>::Size };
+	template <typename TOption>
+	struct DataOffset
+	{
+		enum { Value = sizeof(pbDHCPMagicCookie) + DHCPOptionOffset<TOption, TOptions...>::Value + 2 };
+	};
+	static void Initialize(BYTE* const pbOptions)
+	{
+		CopyMemory(pbOptions, pbDHCPMagicCookie, sizeof(pbDHCPMagicCookie));
+		DHCPOptionHeaders<TOptions...>::Write(pbOptions + sizeof(pbDHCPMagicCookie));
+	}
+	template <typename TOption>
+	static void SetByte(BYTE* const pbOptions, const BYTE bValue)
+	{
+		C_ASSERT(sizeof(bValue) == TOption::DataSize);
+		pbOptions[DataOffset<TOption>::Value] = bValue;
+	}
+	template <typename TOption>
+	static void SetDWORD(BYTE* const pbOptions, const DWORD dwValue)
+	{
+		C_ASSERT(sizeof(dwValue) == TOption::DataSize);
+		// Option data is not aligned, so copy instead of storing through a DWORD*
+		CopyMemory(pbOptions + DataOffset<TOption>::Value, &dwValue, sizeof(dwValue));
+	}
+};
+
+// OFFER and ACK (RFC 2131 section 4.3.1 table 3)
+typedef DHCPOptionLayout<DHCPMessageTypeOption, DHCPLeaseTimeOption, DHCPRenewalTimeOption, DHCPRebindingTimeOption, DHCPSubnetMaskOption, DHCPServerIdentifierOption> DHCPLeaseReplyLayout;
+// NAK (RFC 2131 section 4.3.1 table 3)
+typedef DHCPOptionLayout<DHCPMessageTypeOption, DHCPServerIdentifierOption> DHCPNAKReplyLayout;
+C_ASSERT((int)DHCPNAKReplyLayout::Size <= (int)DHCPLeaseReplyLayout::Size);
+C_ASSERT((int)DHCPLeaseReplyLayout::Size == MAX_DHCP_REPLY_OPTIONS_SIZE);
+
+// Clients that boot together would otherwise renew together every T1 for as
+// long as they run. RFC 2131 section 4.4.5 sets T1 and T2 to 0.5 and 0.875 of
+// the lease time; both are shifted by a per-client offset (derived from the
+// client identifier, so it is the same at every renewal) that spreads clients
+// evenly over dwRenewalJitter percent of the lease time.
+void GetRenewalTimes(const DWORD dwLeaseTime, const DWORD dwRenewalJitter, const BYTE* const pbClientIdentifier, const DWORD dwClientIdentifierSize, DWORD* const pdwRenewalTime, DWORD* const pdwRebindingTime)
+{
+	ASSERT((0 != dwLeaseTime) && (dwRenewalJitter <= MAX_RENEWAL_JITTER) && (0 != pbClientIdentifier) && (0 != pdwRenewalTime) && (0 != pdwRebindingTime));
+	const DWORD dwWindow = (DWORD)(((ULONGLONG)dwLeaseTime * dwRenewalJitter) / 100);
+	const DWORD dwOffset = (0 != dwWindow) ? (DWORD)(HashClientIdentifier64(pbClientIdentifier, dwClientIdentifierSize) % dwWindow) : 0;
+	*pdwRenewalTime = (dwLeaseTime / 2) - (dwWindow / 2) + dwOffset;
+	*pdwRebindingTime = (DWORD)(((ULONGLONG)dwLeaseTime * 7) / 8) - (dwWindow / 2) + dwOffset;
+	ASSERT((0 < *pdwRenewalTime) && (*pdwRenewalTime < *pdwRebindingTime) && (*pdwRebindingTime < dwLeaseTime));
+}
+
+int WriteDHCPServerOptions(BYTE* const pbOptions, const BYTE bMessageType, const DWORD dwLeaseTime, const DWORD dwRenewalTime, const DWORD dwRebindingTime, const DWORD dwMask, const DWORD dwServerAddr)
+{
+	ASSERT((0 != pbOptions) && (0 != dwLeaseTime) && (0 != dwRenewalTime) && (0 != dwRebindingTime) && (0 != dwMask) && (0 != dwServerAddr));
+	int iOptionsSize = 0;
+	switch (bMessageType)
+	{
+	case DHCPMessageType_OFFER:
+		// Fall-through
+	case DHCPMessageType_ACK:
+		DHCPLeaseReplyLayout::Initialize(pbOptions);
+		DHCPLeaseReplyLayout::SetByte<DHCPMessageTypeOption>(pbOptions, bMessageType);
+		DHCPLeaseReplyLayout::SetDWORD<DHCPLeaseTimeOption>(pbOptions, htonl(dwLeaseTime));
+		DHCPLeaseReplyLayout::SetDWORD<DHCPRenewalTimeOption>(pbOptions, htonl(dwRenewalTime));
+		DHCPLeaseReplyLayout::SetDWORD<DHCPRebindingTimeOption>(pbOptions, htonl(dwRebindingTime));
+		DHCPLeaseReplyLayout::SetDWORD<DHCPSubnetMaskOption>(pbOptions, dwMask);  // Already in network order
+		DHCPLeaseReplyLayout::SetDWORD<DHCPServerIdentifierOption>(pbOptions, dwServerAddr);  // Already in network order
+		iOptionsSize = DHCPLeaseReplyLayout::Size;
+		break;
+	case DHCPMessageType_NAK:
+		DHCPNAKReplyLayout::Initialize(pbOptions);
+		DHCPNAKReplyLayout::SetByte<DHCPMessageTypeOption>(pbOptions, bMessageType);
+		DHCPNAKReplyLayout::SetDWORD<DHCPServerIdentifierOption>(pbOptions, dwServerAddr);  // Already in network order
+		iOptionsSize = DHCPNAKReplyLayout::Size;
+		break;
+	default:
+		ASSERT(!"Invalid DHCPMessageType");
+		break;
+	}
+	return iOptionsSize;
+}
+
+const char* const ppcsFlightRecordDecisionNames[] =
+{
+	"-",
+	"dropped (failed initial checks)",
+	"dropped (invalid or missing message type)",
+	"ignored (server host name)",
+	"offered",
+	"not offered (no more addresses)",
+	"acked",
+	"naked (unknown client)",
+	"naked (wrong address)",
+	"dropped (invalid request)",
+	"ignored (decline)",
+	"ignored (release)",
+	"ignored (inform)",
+	"dropped (unexpected message type)",
+	"released",
+	"dropped (reply buffer too small)",
+	"ignored (client chose another server)",
+};
+C_ASSERT(FlightRecordDecision_COUNT == ARRAY_LENGTH(ppcsFlightRecordDecisionNames));
+
+ServerState* CreateServerState(const ServerConfiguration* const psc)
+{
+	ASSERT(0 != psc);
+	ServerState* pss = (ServerState*)LocalAlloc(LMEM_FIXED, sizeof(ServerState));
+	if (0 != pss)
+	{
+		pss->scConfiguration = *psc;
+		pss->pssNextRetired = 0;
+		LeaseTable* const plt = &(pss->ltAddressesInUse);
+		if (InitializeLeaseTable(plt, psc->dwMinAddrValue, psc->dwMaxAddrValue))
+		{
+			// Server entry is only entry without a client ID (and is absent if the server address is outside the range)
+			AddLease(plt, DWIPtoValue(psc->dwServerAddr), 0, 0, "", LeaseState_RESERVED);
+			// Reservations are leases that exist before their clients ask for them
+			for (DWORD i = 0; i < psc->dwReservations; i++)
+			{
+				const Reservation* const pr = &(psc->prReservations[i]);
+				VERIFY(AddLease(plt, pr->dwAddrValue, pr->pbClientIdentifier, pr->dwClientIdentifierSize, "", LeaseState_RESERVED));
+			}
+		}
+		else
+		{
+			VERIFY(0 == LocalFree(pss));
+			pss = 0;
+		}
+	}
+	return pss;
+}
+
+void FreeServerState(ServerState* const pss)
+{
+	ASSERT(0 != pss);
+	FreeLeaseTable(&(pss->ltAddressesInUse));
+	VERIFY(0 == LocalFree(pss));
+}
+
+void QueueServerState(ServerStateExchange* const psse, ServerState* const pss)
+{
+	ASSERT((0 != psse) && (0 != pss));
+	ServerState* const pssReplaced = (ServerState*)InterlockedExchangePointer((PVOID volatile*)&(psse->pssPending), pss);
+	if (0 != pssReplaced)
+	{
+		FreeServerState(pssReplaced);  // Never seen by the packet thread
+	}
+}
+
+void FreeRetiredServerStates(ServerStateExchange* const psse)
+{
+	ASSERT(0 != psse);
+	ServerState* pss = (ServerState*)InterlockedExchangePointer((PVOID volatile*)&(psse->pssRetired), 0);
+	while (0 != pss)
+	{
+		ServerState* const pssNext = pss->pssNextRetired;
+		FreeServerState(pss);
+		pss = pssNext;
+	}
+}
+
+void RaiseDHCPEngineEvent(const DHCPEngine* const pde, const DHCPEngineEvent* const pdeeEvent)
+{
+	ASSERT((0 != pde) && (0 != pdeeEvent));
+	if (0 != pde->pfnEventCallback)
+	{
+		pde->pfnEventCallback(pde->pvEventContext, pdeeEvent);
+	}
+}
+
+void RaiseClientEvent(const DHCPEngine* const pde, const DHCPEngineEventTypes deetType, const DWORD dwAddr, const char* const pcsHostName, const BYTE* const pbClientIdentifier, const DWORD dwClientIdentifierSize)
+{
+	ASSERT((0 != pde) && (0 != pcsHostName) && (0 != pbClientIdentifier));
+	DHCPEngineEvent deeEvent;
+	ZeroMemory(&deeEvent, sizeof(deeEvent));
+	deeEvent.deetType = deetType;
+	deeEvent.dwAddr = dwAddr;
+	deeEvent.pcsHostName = pcsHostName;
+	deeEvent.pbClientIdentifier = pbClientIdentifier;
+	deeEvent.dwClientIdentifierSize = dwClientIdentifierSize;
+	RaiseDHCPEngineEvent(pde, &deeEvent);
+}
+
+void RaiseAckedEvent(const DHCPEngine* const pde, const DWORD dwAddr, const char* const pcsHostName, const BYTE* const pbClientIdentifier, const DWORD dwClientIdentifierSize, const DWORD dwLeaseTime)
+{
+	ASSERT((0 != pde) && (0 != pcsHostName) && (0 != pbClientIdentifier) && (0 != dwLeaseTime));
+	DHCPEngineEvent deeEvent;
+	ZeroMemory(&deeEvent, sizeof(deeEvent));
+	deeEvent.deetType = DHCPEngineEventType_ACKED;
+	deeEvent.dwAddr = dwAddr;
+	deeEvent.pcsHostName = pcsHostName;
+	deeEvent.pbClientIdentifier = pbClientIdentifier;
+	deeEvent.dwClientIdentifierSize = dwClientIdentifierSize;
+	deeEvent.dwLeaseTime = dwLeaseTime;
+	RaiseDHCPEngineEvent(pde, &deeEvent);
+}
+
+void RaiseInvalidMessageEvent(const DHCPEngine* const pde, const char* const pcsDescription)
+{
+	ASSERT((0 != pde) && (0 != pcsDescription));
+	DHCPEngineEvent deeEvent;
+	ZeroMemory(&deeEvent, sizeof(deeEvent));
+	deeEvent.deetType = DHCPEngineEventType_INVALIDMESSAGE;
+	deeEvent.pcsDescription = pcsDescription;
+	RaiseDHCPEngineEvent(pde, &deeEvent);
+}
+
+// A bound lease's name has been reported (ACKED), so a change reports the name it replaces
+void UpdateClientLeaseHostName(const DHCPEngine* const pde, LeaseTable* const plt, const int iIndex, const char* const pcsHostName, const BYTE* const pbClientIdentifier, const DWORD dwClientIdentifierSize)
+{
+	ASSERT((0 != pde) && (0 != plt) && (0 <= iIndex) && ((DWORD)iIndex < plt->dwSlotCount) && (0 != pcsHostName) && (0 != pbClientIdentifier));
+	const AddressInUseInformation* const paiui = &(plt->paiuiSlots[iIndex]);
+	char pcsPreviousHostName[MAX_STORED_HOSTNAME_LENGTH];
+	strncpy_s(pcsPreviousHostName, sizeof(pcsPreviousHostName), paiui->pcsHostName, _TRUNCATE);
+	if (UpdateLeaseHostName(plt, iIndex, pcsHostName) && (LeaseState_BOUND == paiui->lsState) && ('\0' != pcsPreviousHostName[0]))
+	{
+		DHCPEngineEvent deeEvent;
+		ZeroMemory(&deeEvent, sizeof(deeEvent));
+		deeEvent.deetType = DHCPEngineEventType_RENAMED;
+		deeEvent.dwAddr = DWValuetoIP(paiui->dwAddrValue);
+		deeEvent.pcsHostName = paiui->pcsHostName;
+		deeEvent.pcsPreviousHostName = pcsPreviousHostName;
+		deeEvent.pbClientIdentifier = pbClientIdentifier;
+		deeEvent.dwClientIdentifierSize = dwClientIdentifierSize;
+		RaiseDHCPEngineEvent(pde, &deeEvent);
+	}
+}
+
+// Returns true if the lease was kept
+bool MigrateLease(LeaseTable* const pltNew, const AddressInUseInformation* const paiui, const ULONGLONG qwOfferExpireTime)
+{
+	ASSERT((0 != pltNew) && (0 != paiui) && ((LeaseState_BOUND == paiui->lsState) || (LeaseState_RELEASED == paiui->lsState) || (LeaseState_OFFERED == paiui->lsState)));
+	bool bMigrated = false;
+	const int iNewIndex = FindLeaseTableIndexOfAddress(pltNew, paiui->dwAddrValue);
+	// Only a prefix of a long client identifier is stored, so it is matched by its saved hash
+	const int iClientIndex = FindLeaseTableIndexOfClientIdentifierHash(pltNew, paiui->pbClientIdentifier, paiui->dwClientIdentifierSize, paiui->qwClientIdentifierHash);
+	if ((-1 != iNewIndex) && (iNewIndex == iClientIndex))
+	{
+		// Reserved for this client
+		ASSERT(LeaseState_RESERVED == pltNew->paiuiSlots[iNewIndex].lsState);
+		UpdateLeaseHostName(pltNew, iNewIndex, paiui->pcsHostName);
+		if (LeaseState_BOUND == paiui->lsState)
+		{
+			SetLeaseState(pltNew, iNewIndex, LeaseState_BOUND);
+		}
+		bMigrated = true;
+	}
+	else if ((-1 != iNewIndex) && (LeaseState_FREE == pltNew->paiuiSlots[iNewIndex].lsState) && (-1 == iClientIndex))
+	{
+		VERIFY(AddLeaseWithClientIdentifierHash(pltNew, paiui->dwAddrValue, paiui->pbClientIdentifier, paiui->dwClientIdentifierSize, paiui->qwClientIdentifierHash, paiui->pcsHostName, paiui->lsState));
+		if (LeaseState_OFFERED == paiui->lsState)
+		{
+			AppendOfferExpiry(pltNew, iNewIndex, qwOfferExpireTime);
+		}
+		bMigrated = true;
+	}
+	else
+	{
+		// Outside the new range, reserved for another client, or the client is reserved elsewhere; it is NAKed at renewal and starts over
+	}
+	return bMigrated;
+}
+
+void MigrateLeases(const DHCPEngine* const pde, LeaseTable* const pltNew, const LeaseTable* const pltOld, const ULONGLONG qwNewOfferExpireTime, DWORD* const pdwMigrated, DWORD* const pdwDropped)
+{
+	ASSERT((0 != pde) && (0 != pltNew) && (0 != pltOld) && (0 != pdwMigrated) && (0 != pdwDropped));
+	*pdwMigrated = 0;
+	*pdwDropped = 0;
+	for (DWORD i = 0; i < pltOld->dwSlotCount; i++)
+	{
+		const AddressInUseInformation* const paiui = &(pltOld->paiuiSlots[i]);
+		if ((LeaseState_BOUND == paiui->lsState) || (LeaseState_RELEASED == paiui->lsState))
+		{
+			if (MigrateLease(pltNew, paiui, 0))
+			{
+				(*pdwMigrated)++;
+			}
+			else
+			{
+				(*pdwDropped)++;
+				if (LeaseState_BOUND == paiui->lsState)
+				{
+					// Its address may go to another client, so the host stops publishing it under this name
+					RaiseClientEvent(pde, DHCPEngineEventType_DROPPED, DWValuetoIP(paiui->dwAddrValue), paiui->pcsHostName, paiui->pbClientIdentifier, StoredClientIdentifierSize(paiui->dwClientIdentifierSize));
+				}
+			}
+		}
+	}
+	// Oldest first, and no later than offers made under the new hold time, so the new queue stays in expiry order
+	for (int iIndex = pltOld->iOldestOfferIndex; -1 != iIndex; iIndex = pltOld->paiuiSlots[iIndex].iNewerOfferIndex)
+	{
+		const AddressInUseInformation* const paiui = &(pltOld->paiuiSlots[iIndex]);
+		if (MigrateLease(pltNew, paiui, min(paiui->qwOfferExpireTime, qwNewOfferExpireTime)))
+		{
+			(*pdwMigrated)++;
+		}
+		else
+		{
+			(*pdwDropped)++;
+		}
+	}
+}
+
+// Returns true if a pending state was applied
+bool ApplyPendingServerState(DHCPEngine* const pde, const ULONGLONG qwNow, DWORD* const pdwMigrated, DWORD* const pdwDropped)
+{
+	ASSERT((0 != pde) && (0 != pdwMigrated) && (0 != pdwDropped));
+	ServerStateExchange* const psse = &(pde->sseServerState);
+	ServerState* pssPending = 0;
+	if (0 != psse->pssPending)
+	{
+		// Set first so the other thread never sees neither a pending nor an applying state before the old one is retired
+		InterlockedExchange(&(psse->lApplying), TRUE);
+		pssPending = (ServerState*)InterlockedExchangePointer((PVOID volatile*)&(psse->pssPending), 0);
+		if (0 != pssPending)
+		{
+			ServerState* const pssOld = psse->pssCurrent;
+			ASSERT(pssOld->scConfiguration.dwServerAddr == pssPending->scConfiguration.dwServerAddr);
+			MigrateLeases(pde, &(pssPending->ltAddressesInUse), &(pssOld->ltAddressesInUse), qwNow + (pssPending->scConfiguration.dwOfferHoldTime * 1000ULL), pdwMigrated, pdwDropped);
+			InterlockedExchangePointer((PVOID volatile*)&(psse->pssCurrent), pssPending);
+			ServerState* pssRetired;
+			do
+			{
+				pssRetired = psse->pssRetired;
+				pssOld->pssNextRetired = pssRetired;
+			} while (pssRetired != InterlockedCompareExchangePointer((PVOID volatile*)&(psse->pssRetired), pssOld, pssRetired));
+		}
+		InterlockedExchange(&(psse->lApplying), FALSE);
+	}
+	return (0 != pssPending);
+}
+
+bool FindOptionData(const BYTE bOption, const BYTE* const pbOptions, const int iOptionsSize, const BYTE** const ppbOptionData, unsigned int* const piOptionDataSize)
+{
+	ASSERT(((0 == iOptionsSize) || (0 != pbOptions)) && (0 != ppbOptionData) && (0 != piOptionDataSize) &&
+		(option_PAD != bOption) && (option_END != bOption));
+	bool bSuccess = false;
+	// RFC 2132
+	bool bHitEND = false;
+	const BYTE* pbCurrentOption = pbOptions;
+	while (((pbCurrentOption - pbOptions) < iOptionsSize) && !bHitEND && !bSuccess)
+	{
+		const BYTE bCurrentOption = *pbCurrentOption;
+		if (option_PAD == bCurrentOption)
+		{
+			pbCurrentOption++;
+		}
+		else if (option_END == bCurrentOption)
+		{
+			bHitEND = true;
+		}
+		else
+		{
+			pbCurrentOption++;
+			if ((pbCurrentOption - pbOptions) < iOptionsSize)
+			{
+				const BYTE bCurrentOptionLen = *pbCurrentOption;
+				pbCurrentOption++;
+				if (bCurrentOptionLen <= iOptionsSize - (pbCurrentOption - pbOptions))
+				{
+					if (bOption == bCurrentOption)
+					{
+						*ppbOptionData = pbCurrentOption;
+						*piOptionDataSize = bCurrentOptionLen;
+						bSuccess = true;
+					}
+					pbCurrentOption += bCurrentOptionLen;
+				}
+				else
+				{
+					// Invalid option data (length runs past the end of the message); options before it are still found
+					pbCurrentOption = pbOptions + iOptionsSize;
+				}
+			}
+			else
+			{
+				// Invalid option data (not enough room for required length byte); options before it are still found
+			}
+		}
+	}
+	return bSuccess;
+}
+
+bool GetDHCPMessageType(const BYTE* const pbOptions, const int iOptionsSize, DHCPMessageTypes* const pdhcpmtMessageType)
+{
+	ASSERT(((0 == iOptionsSize) || (0 != pbOptions)) && (0 != pdhcpmtMessageType));
+	bool bSuccess = false;
+	const BYTE* pbDHCPMessageTypeData;
+	unsigned int iDHCPMessageTypeDataSize;
+	if (FindOptionData(option_DHCPMESSAGETYPE, pbOptions, iOptionsSize, &pbDHCPMessageTypeData, &iDHCPMessageTypeDataSize) &&
+		(1 == iDHCPMessageTypeDataSize) && (1 <= *pbDHCPMessageTypeData) && (*pbDHCPMessageTypeData <= 8))
+	{
+		*pdhcpmtMessageType = (DHCPMessageTypes)(*pbDHCPMessageTypeData);
+		bSuccess = true;
+	}
+	return bSuccess;
+}
+
+bool InitializeDHCPEngine(DHCPEngine* const pde, const ServerConfiguration* const psc, const char* const pcsServerHostName, const DHCPEngineEventCallback pfnEventCallback, void* const pvEventContext)
+{
+	ASSERT((0 != pde) && (0 != psc) && (0 != pcsServerHostName));
+	pde->sseServerState.pssCurrent = CreateServerState(psc);
+	pde->sseServerState.pssPending = 0;
+	pde->sseServerState.pssRetired = 0;
+	pde->sseServerState.lApplying = FALSE;
+	strncpy_s(pde->pcsServerHostName, sizeof(pde->pcsServerHostName), pcsServerHostName, _TRUNCATE);
+	pde->pfnEventCallback = pfnEventCallback;
+	pde->pvEventContext = pvEventContext;
+	return (0 != pde->sseServerState.pssCurrent);
+}
+
+void FreeDHCPEngine(DHCPEngine* const pde)
+{
+	ASSERT(0 != pde);
+	FreeRetiredServerStates(&(pde->sseServerState));
+	if (0 != pde->sseServerState.pssPending)
+	{
+		FreeServerState(pde->sseServerState.pssPending);
+		pde->sseServerState.pssPending = 0;
+	}
+	if (0 != pde->sseServerState.pssCurrent)
+	{
+		FreeServerState(pde->sseServerState.pssCurrent);
+		pde->sseServerState.pssCurrent = 0;
+	}
+}
+
+void UpdateDHCPEngine(DHCPEngine* const pde, const ULONGLONG qwNow)
+{
+	ASSERT((0 != pde) && (0 != pde->sseServerState.pssCurrent));
+	DHCPEngineEvent deeEvent;
+	ZeroMemory(&deeEvent, sizeof(deeEvent));
+	if (ApplyPendingServerState(pde, qwNow, &(deeEvent.dwCount), &(deeEvent.dwDropped)))
+	{
+		deeEvent.deetType = DHCPEngineEventType_RELOADED;
+		RaiseDHCPEngineEvent(pde, &deeEvent);
+	}
+	ZeroMemory(&deeEvent, sizeof(deeEvent));
+	deeEvent.dwCount = ExpireOffers(&(pde->sseServerState.pssCurrent->ltAddressesInUse), qwNow);
+	if (0 != deeEvent.dwCount)
+	{
+		deeEvent.deetType = DHCPEngineEventType_OFFERSEXPIRED;
+		RaiseDHCPEngineEvent(pde, &deeEvent);
+	}
+}
+
+const ServerState* GetCurrentDHCPEngineState(const DHCPEngine* const pde)
+{
+	ASSERT(0 != pde);
+	return pde->sseServerState.pssCurrent;
+}
+
+bool QueueDHCPEngineConfiguration(DHCPEngine* const pde, const ServerConfiguration* const psc)
+{
+	ASSERT((0 != pde) && (0 != psc) && (psc->dwServerAddr == pde->sseServerState.pssCurrent->scConfiguration.dwServerAddr));
+	ServerState* const pss = CreateServerState(psc);
+	if (0 != pss)
+	{
+		QueueServerState(&(pde->sseServerState), pss);
+	}
+	return (0 != pss);
+}
+
+bool IsDHCPEngineConfigurationPending(const DHCPEngine* const pde)
+{
+	ASSERT(0 != pde);
+	return (0 != pde->sseServerState.pssPending) || (0 != pde->sseServerState.lApplying);
+}
+
+void FreeRetiredDHCPEngineStates(DHCPEngine* const pde)
+{
+	ASSERT(0 != pde);
+	FreeRetiredServerStates(&(pde->sseServerState));
+}
+
+int ProcessDHCPClientRequest(DHCPEngine* const pde, const BYTE* const pbRequest, const int iRequestSize, const ULONGLONG qwNow, BYTE* const pbReply, const int iReplyBufferSize, DWORD* const pdwReplyAddr, FlightRecord* const pfrOptionalRecord)
+{
+	ASSERT((0 != pde) && ((0 == iRequestSize) || (0 != pbRequest)) && (0 != pbReply) && (0 != pdwReplyAddr));
+	int iReplySize = 0;
+	FlightRecord frUnused;  // Written instead when the host keeps no record
+	ZeroMemory(&frUnused, sizeof(frUnused));
+	FlightRecord* const pfrRecord = (0 != pfrOptionalRecord) ? pfrOptionalRecord : &frUnused;
+	// Checked in every build (and before anything changes): the reply is only ever written into the caller's buffer
+	if ((int)MAX_DHCP_REPLY_SIZE <= iReplyBufferSize)
+	{
+		UpdateDHCPEngine(pde, qwNow);
+		ServerState* const pss = pde->sseServerState.pssCurrent;
+		const ServerConfiguration* const psc = &(pss->scConfiguration);
+		LeaseTable* const plt = &(pss->ltAddressesInUse);
+		const char* const pcsServerHostName = pde->pcsServerHostName;
+		const DHCPMessage* const pdhcpmRequest = (DHCPMessage*)pbRequest;
+		if ((((sizeof(*pdhcpmRequest) + sizeof(pbDHCPMagicCookie)) <= iRequestSize) &&  // Take into account mandatory DHCP magic cookie values in options array (RFC 2131 section 3)
+			(op_BOOTREQUEST == pdhcpmRequest->op) &&
+			// (pdhcpmRequest->htype) && // Could also validate htype
+			(0 == memcmp(pbDHCPMagicCookie, pdhcpmRequest->options, sizeof(pbDHCPMagicCookie))))
+			)
+		{
+			const BYTE* const pbOptions = pdhcpmRequest->options + sizeof(pbDHCPMagicCookie);
+			const int iOptionsSize = iRequestSize - (int)sizeof(*pdhcpmRequest) - (int)sizeof(pbDHCPMagicCookie);
+			DHCPMessageTypes dhcpmtMessageType;
+			if (GetDHCPMessageType(pbOptions, iOptionsSize, &dhcpmtMessageType))
+			{
+				pfrRecord->bMessageType = (BYTE)dhcpmtMessageType;
+				// Determine client host name
+				char pcsClientHostName[MAX_HOSTNAME_LENGTH];
+				pcsClientHostName[0] = '\0';
+				const BYTE* pbRequestHostNameData;
+				unsigned int iRequestHostNameDataSize;
+				if (FindOptionData(option_HOSTNAME, pbOptions, iOptionsSize, &pbRequestHostNameData, &iRequestHostNameDataSize))
+				{
+					const size_t stHostNameCopySize = min(iRequestHostNameDataSize + 1, ARRAY_LENGTH(pcsClientHostName));
+					_tcsncpy_s(pcsClientHostName, stHostNameCopySize, (char*)pbRequestHostNameData, _TRUNCATE);
+				}
+				if (('\0' == pcsServerHostName[0]) || (0 != _stricmp(pcsClientHostName, pcsServerHostName)))
+				{
+					// Determine client identifier in proper RFC 2131 order (client identifier option then chaddr)
+					const BYTE* pbRequestClientIdentifierData;
+					unsigned int iRequestClientIdentifierDataSize;
+					if (!FindOptionData(option_CLIENTIDENTIFIER, pbOptions, iOptionsSize, &pbRequestClientIdentifierData, &iRequestClientIdentifierDataSize))
+					{
+						pbRequestClientIdentifierData = pdhcpmRequest->chaddr;
+						iRequestClientIdentifierDataSize = sizeof(pdhcpmRequest->chaddr);
+					}
+					// Determine if we've seen this client before
+					bool bSeenClientBefore = false;
+					DWORD dwClientPreviousOfferAddr = (DWORD)INADDR_BROADCAST;  // Invalid IP address for later comparison
+					const int iIndex = FindLeaseTableIndexOfClientIdentifier(plt, pbRequestClientIdentifierData, (DWORD)iRequestClientIdentifierDataSize);
+					if (-1 != iIndex)
+					{
+						dwClientPreviousOfferAddr = DWValuetoIP(plt->paiuiSlots[iIndex].dwAddrValue);
+						bSeenClientBefore = true;
+					}
+					// Server message handling
+					// RFC 2131 section 4.3
+					ZeroMemory(pbReply, MAX_DHCP_REPLY_SIZE);
+					DHCPMessage* const pdhcpmReply = (DHCPMessage*)pbReply;
+					pdhcpmReply->op = op_BOOTREPLY;
+					pdhcpmReply->htype = pdhcpmRequest->htype;
+					pdhcpmReply->hlen = pdhcpmRequest->hlen;
+					// pdhcpmReply->hops = 0;
+					pdhcpmReply->xid = pdhcpmRequest->xid;
+					// pdhcpmReply->ciaddr = 0;
+					// pdhcpmReply->yiaddr = 0;  Or changed below
+					// pdhcpmReply->siaddr = 0;
+					pdhcpmReply->flags = pdhcpmRequest->flags;
+					pdhcpmReply->giaddr = pdhcpmRequest->giaddr;
+					CopyMemory(pdhcpmReply->chaddr, pdhcpmRequest->chaddr, sizeof(pdhcpmReply->chaddr));
+					strncpy_s((char*)(pdhcpmReply->sname), sizeof(pdhcpmReply->sname), pcsServerName, _TRUNCATE);
+					// pdhcpmReply->file = 0;
+					// pdhcpmReply->options below (once the message type is known)
+					BYTE bReplyMessageType = 0;  // Invalid message type for later comparison
+					bool bSendDHCPMessage = false;
+					switch (dhcpmtMessageType)
+					{
+					case DHCPMessageType_DISCOVER:
+					{
+						// RFC 2131 section 4.3.1
+						// UNSUPPORTED: Requested IP Address option
+						const DWORD dwMinAddrValue = plt->dwMinAddrValue;
+						const DWORD dwMaxAddrValue = plt->dwMinAddrValue + plt->dwSlotCount - 1;
+						DWORD dwOfferAddrValue;
+						bool bOfferAddrValueValid = false;
+						if (bSeenClientBefore)
+						{
+							dwOfferAddrValue = DWIPtoValue(dwClientPreviousOfferAddr);
+							bOfferAddrValueValid = true;
+						}
+						else
+						{
+							const int iHashedIndex = (AddressAssignmentMode_HASH == psc->aamMode) ?
+								FindHashedLeaseTableIndex(plt, pbRequestClientIdentifierData, iRequestClientIdentifierDataSize) : -1;
+							if (-1 != iHashedIndex)
+							{
+								dwOfferAddrValue = plt->paiuiSlots[iHashedIndex].dwAddrValue;
+								bOfferAddrValueValid = true;
+							}
+							else
+							{
+								dwOfferAddrValue = plt->dwLastOfferAddrValue + 1;
+							}
+						}
+						// Search for an available address if necessary
+						const DWORD dwInitialOfferAddrValue = dwOfferAddrValue;
+						bool bOfferedInitialValue = false;
+						while (!bOfferAddrValueValid && !(bOfferedInitialValue && (dwInitialOfferAddrValue == dwOfferAddrValue)))  // Detect address exhaustion
+						{
+							if (dwMaxAddrValue < dwOfferAddrValue)
+							{
+								ASSERT(dwMaxAddrValue + 1 == dwOfferAddrValue);
+								dwOfferAddrValue = dwMinAddrValue;
+							}
+							const int iOfferIndex = FindLeaseTableIndexOfAddress(plt, dwOfferAddrValue);
+							bOfferAddrValueValid = (-1 != iOfferIndex) && (LeaseState_FREE == plt->paiuiSlots[iOfferIndex].lsState);
+							bOfferedInitialValue = true;
+							if (!bOfferAddrValueValid)
+							{
+								dwOfferAddrValue++;
+							}
+						}
+						if (bOfferAddrValueValid)
+						{
+							plt->dwLastOfferAddrValue = dwOfferAddrValue;
+							const DWORD dwOfferAddr = DWValuetoIP(dwOfferAddrValue);
+							ASSERT((0 != iRequestClientIdentifierDataSize) && (0 != pbRequestClientIdentifierData));
+							const ULONGLONG qwOfferExpireTime = qwNow + (psc->dwOfferHoldTime * 1000ULL);
+							if (bSeenClientBefore)
+							{
+								UpdateClientLeaseHostName(pde, plt, iIndex, pcsClientHostName, pbRequestClientIdentifierData, iRequestClientIdentifierDataSize);
+								if (LeaseState_OFFERED == plt->paiuiSlots[iIndex].lsState)
+								{
+									// Restart the hold
+									UnlinkOfferExpiry(plt, iIndex);
+									AppendOfferExpiry(plt, iIndex, qwOfferExpireTime);
+								}
+							}
+							else
+							{
+								VERIFY(AddLease(plt, dwOfferAddrValue, pbRequestClientIdentifierData, iRequestClientIdentifierDataSize, pcsClientHostName, LeaseState_OFFERED));
+								AppendOfferExpiry(plt, FindLeaseTableIndexOfAddress(plt, dwOfferAddrValue), qwOfferExpireTime);
+							}
+							pdhcpmReply->yiaddr = dwOfferAddr;
+							bReplyMessageType = DHCPMessageType_OFFER;
+							bSendDHCPMessage = true;
+							pfrRecord->bDecision = FlightRecordDecision_OFFERED;
+							pfrRecord->dwAddr = dwOfferAddr;
+							RaiseClientEvent(pde, DHCPEngineEventType_OFFERED, dwOfferAddr, pcsClientHostName, pbRequestClientIdentifierData, iRequestClientIdentifierDataSize);
+						}
+						else
+						{
+							pfrRecord->bDecision = FlightRecordDecision_NOT_OFFERED_EXHAUSTED;
+							RaiseClientEvent(pde, DHCPEngineEventType_EXHAUSTED, 0, pcsClientHostName, pbRequestClientIdentifierData, iRequestClientIdentifierDataSize);
+						}
+					}
+					break;
+					case DHCPMessageType_REQUEST:
+					{
+						// RFC 2131 section 4.3.2
+						// Determine requested IP address
+						DWORD dwRequestedIPAddress = INADDR_BROADCAST;  // Invalid IP address for later comparison
+						const BYTE* pbRequestRequestedIPAddressData = 0;
+						unsigned int iRequestRequestedIPAddressDataSize = 0;
+						if (FindOptionData(option_REQUESTEDIPADDRESS, pbOptions, iOptionsSize, &pbRequestRequestedIPAddressData, &iRequestRequestedIPAddressDataSize) && (sizeof(dwRequestedIPAddress) == iRequestRequestedIPAddressDataSize))
+						{
+							CopyMemory(&dwRequestedIPAddress, pbRequestRequestedIPAddressData, sizeof(dwRequestedIPAddress));  // Options are not aligned
+						}
+						// Determine server identifier
+						DWORD dwRequestServerIdentifier = INADDR_ANY;  // Absent
+						const BYTE* pbRequestServerIdentifierData = 0;
+						unsigned int iRequestServerIdentifierDataSize = 0;
+						if (FindOptionData(option_SERVERIDENTIFIER, pbOptions, iOptionsSize, &pbRequestServerIdentifierData, &iRequestServerIdentifierDataSize) && (sizeof(dwRequestServerIdentifier) == iRequestServerIdentifierDataSize))
+						{
+							CopyMemory(&dwRequestServerIdentifier, pbRequestServerIdentifierData, sizeof(dwRequestServerIdentifier));  // Options are not aligned
+						}
+						if (psc->dwServerAddr == dwRequestServerIdentifier)
+						{
+							// Response to OFFER
+							// DHCPREQUEST generated during SELECTING state
+							ASSERT(0 == pdhcpmRequest->ciaddr);
+							if (bSeenClientBefore)
+							{
+								// Already have an IP address for this client - ACK it
+								bReplyMessageType = DHCPMessageType_ACK;
+								// Will set other options below
+							}
+							else
+							{
+								// Haven't seen this client before - NAK it
+								bReplyMessageType = DHCPMessageType_NAK;
+								pfrRecord->bDecision = FlightRecordDecision_NAKED_UNKNOWNCLIENT;
+								// Will prepare to send message below
+							}
+						}
+						else if (INADDR_ANY != dwRequestServerIdentifier)
+						{
+							// DHCPREQUEST generated during SELECTING state for another server's offer
+							// The client declined this server's offer, so withdraw it and don't reply
+							if (bSeenClientBefore && (LeaseState_OFFERED == plt->paiuiSlots[iIndex].lsState))
+							{
+								UnlinkOfferExpiry(plt, iIndex);
+								RemoveLease(plt, iIndex);
+							}
+							pfrRecord->bDecision = FlightRecordDecision_IGNORED_OTHERSERVER;
+						}
+						else
+						{
+							// Request to verify or extend
+							if (((INADDR_BROADCAST != dwRequestedIPAddress) /*&& (0 == pdhcpmRequest->ciaddr)*/) ||  // DHCPREQUEST generated during INIT-REBOOT state - Some clients set ciaddr in this case, so deviate from the spec by allowing it
+								((INADDR_BROADCAST == dwRequestedIPAddress) && (0 != pdhcpmRequest->ciaddr)))  // Unicast -> DHCPREQUEST generated during RENEWING state / Broadcast -> DHCPREQUEST generated during REBINDING state
+							{
+								if (bSeenClientBefore && ((dwClientPreviousOfferAddr == dwRequestedIPAddress) || (dwClientPreviousOfferAddr == pdhcpmRequest->ciaddr)))
+								{
+									// Already have an IP address for this client - ACK it
+									bReplyMessageType = DHCPMessageType_ACK;
+									// Will set other options below
+								}
+								else
+								{
+									// Haven't seen this client before or requested IP address is invalid
+									bReplyMessageType = DHCPMessageType_NAK;
+									pfrRecord->bDecision = bSeenClientBefore ? FlightRecordDecision_NAKED_WRONGADDRESS : FlightRecordDecision_NAKED_UNKNOWNCLIENT;
+									// Will prepare to send message below
+								}
+							}
+							else
+							{
+								pfrRecord->bDecision = FlightRecordDecision_DROPPED_INVALIDREQUEST;
+								RaiseInvalidMessageEvent(pde, "Invalid DHCP message (invalid data).");
+							}
+						}
+						switch (bReplyMessageType)
+						{
+						case DHCPMessageType_ACK:
+							ASSERT(INADDR_BROADCAST != dwClientPreviousOfferAddr);
+							pdhcpmReply->ciaddr = dwClientPreviousOfferAddr;
+							pdhcpmReply->yiaddr = dwClientPreviousOfferAddr;
+							UpdateClientLeaseHostName(pde, plt, iIndex, pcsClientHostName, pbRequestClientIdentifierData, iRequestClientIdentifierDataSize);
+							if (LeaseState_OFFERED == plt->paiuiSlots[iIndex].lsState)
+							{
+								UnlinkOfferExpiry(plt, iIndex);
+							}
+							SetLeaseState(plt, iIndex, LeaseState_BOUND);
+							bSendDHCPMessage = true;
+							pfrRecord->bDecision = FlightRecordDecision_ACKED;
+							pfrRecord->dwAddr = dwClientPreviousOfferAddr;
+							RaiseAckedEvent(pde, dwClientPreviousOfferAddr, plt->paiuiSlots[iIndex].pcsHostName, pbRequestClientIdentifierData, iRequestClientIdentifierDataSize, psc->dwLeaseTime);
+							break;
+						case DHCPMessageType_NAK:
+							bSendDHCPMessage = true;
+							RaiseClientEvent(pde, DHCPEngineEventType_NAKED, 0, pcsClientHostName, pbRequestClientIdentifierData, iRequestClientIdentifierDataSize);
+							break;
+						default:
+							// Nothing to do
+							break;
+						}
+					}
+					break;
+					case DHCPMessageType_DECLINE:
+						// UNSUPPORTED: Mark address as unused
+						pfrRecord->bDecision = FlightRecordDecision_IGNORED_DECLINE;
+						break;
+					case DHCPMessageType_RELEASE:
+						// RFC 2131 section 4.3.4
+						// The address stays assigned to the client, so it gets the same one back later
+						if (bSeenClientBefore && (LeaseState_BOUND == plt->paiuiSlots[iIndex].lsState) && (dwClientPreviousOfferAddr == pdhcpmRequest->ciaddr))
+						{
+							SetLeaseState(plt, iIndex, LeaseState_RELEASED);
+							pfrRecord->bDecision = FlightRecordDecision_RELEASED;
+							pfrRecord->dwAddr = dwClientPreviousOfferAddr;
+							RaiseClientEvent(pde, DHCPEngineEventType_RELEASED, dwClientPreviousOfferAddr, plt->paiuiSlots[iIndex].pcsHostName, pbRequestClientIdentifierData, iRequestClientIdentifierDataSize);
+						}
+						else
+						{
+							// Unknown client, wrong address, or not bound
+							pfrRecord->bDecision = FlightRecordDecision_IGNORED_RELEASE;
+						}
+						break;
+					case DHCPMessageType_INFORM:
+						// Unsupported DHCP message type - fail silently
+						pfrRecord->bDecision = FlightRecordDecision_IGNORED_INFORM;
+						break;
+					case DHCPMessageType_OFFER:
+					case DHCPMessageType_ACK:
+					case DHCPMessageType_NAK:
+						pfrRecord->bDecision = FlightRecordDecision_DROPPED_UNEXPECTEDTYPE;
+						RaiseInvalidMessageEvent(pde, "Unexpected DHCP message type.");
+						break;
+					default:
+						ASSERT(!"Invalid DHCPMessageType");
+						break;
+					}
+					if (bSendDHCPMessage)
+					{
+						ASSERT(0 != bReplyMessageType);  // Must have set an option if we're going to be sending this message
+						DWORD dwRenewalTime;
+						DWORD dwRebindingTime;
+						GetRenewalTimes(psc->dwLeaseTime, psc->dwRenewalJitter, pbRequestClientIdentifierData, iRequestClientIdentifierDataSize, &dwRenewalTime, &dwRebindingTime);
+						iReplySize = (int)sizeof(DHCPMessage) + WriteDHCPServerOptions(pdhcpmReply->options, bReplyMessageType, psc->dwLeaseTime, dwRenewalTime, dwRebindingTime, psc->dwMask, psc->dwServerAddr);
+						ASSERT(iReplySize <= iReplyBufferSize);
+						// Determine how to send the reply
+						// RFC 2131 section 4.1
+						u_long ulAddr = INADDR_LOOPBACK;  // Invalid value
+						if (0 == pdhcpmRequest->giaddr)
+						{
+							switch (bReplyMessageType)
+							{
+							case DHCPMessageType_OFFER:
+								// Fall-through
+							case DHCPMessageType_ACK:
+							{
+								if (0 == pdhcpmRequest->ciaddr)
+								{
+									if (0 != (BROADCAST_FLAG & pdhcpmRequest->flags))
+									{
+										ulAddr = INADDR_BROADCAST;
+									}
+									else
+									{
+										ulAddr = pdhcpmRequest->yiaddr;  // Already in network order
+										if (0 == ulAddr)
+										{
+											// UNSUPPORTED: Unicast to hardware address
+											// Instead, broadcast the response and rely on other DHCP clients to ignore it
+											ulAddr = INADDR_BROADCAST;
+										}
+									}
+								}
+								else
+								{
+									ulAddr = pdhcpmRequest->ciaddr;  // Already in network order
+								}
+							}
+							break;
+							case DHCPMessageType_NAK:
+							{
+								ulAddr = INADDR_BROADCAST;
+							}
+							break;
+							default:
+								ASSERT(!"Invalid DHCPMessageType");
+								break;
+							}
+						}
+						else
+						{
+							ulAddr = pdhcpmRequest->giaddr;  // Already in network order
+							pdhcpmReply->flags |= BROADCAST_FLAG;  // Indicate to the relay agent that it must broadcast
+						}
+						ASSERT((INADDR_LOOPBACK != ulAddr) && (0 != ulAddr));
+						*pdwReplyAddr = ulAddr;
+					}
+				}
+				else
+				{
+					// Ignore attempts by the DHCP server to obtain a DHCP address (possible if its current address was obtained by auto-IP) because this would invalidate dwServerAddr
+					pfrRecord->bDecision = FlightRecordDecision_IGNORED_SERVERHOSTNAME;
+				}
+			}
+			else
+			{
+				pfrRecord->bDecision = FlightRecordDecision_DROPPED_MESSAGETYPE;
+				RaiseInvalidMessageEvent(pde, "Invalid DHCP message (invalid or missing DHCP message type).");
+			}
+		}
+		else
+		{
+			pfrRecord->bDecision = FlightRecordDecision_DROPPED_INITIALCHECKS;
+			RaiseInvalidMessageEvent(pde, "Invalid DHCP message (failed initial checks).");
+		}
+	}
+	else
+	{
+		// Nothing is changed (an offer or lease the host cannot send would strand the client)
+		pfrRecord->bDecision = FlightRecordDecision_DROPPED_REPLYBUFFER;
+	}
+	return iReplySize;
+}
+
@@ -0,0 +1,280 @@
+// DHCPLite engine - DHCP message handling, leases, and configuration state with
+// no sockets, threads, console output, or per-message allocation. The host does
+// the I/O: it passes each request (and the time) in and sends the reply it gets
+// back. Engines are independent, so one process can serve several networks.
+
+#if !defined(DHCPLITE_ENGINE_HEADER)
+#define DHCPLITE_ENGINE_HEADER
+
+#include <windows.h>
+#include "toolbox.h"
+
+// For display of host name information
+#define MAX_HOSTNAME_LENGTH (256)
+// RFC 2132 section 9.6
+enum DHCPMessageTypes
+{
+	DHCPMessageType_DISCOVER = 1,
+	DHCPMessageType_OFFER = 2,
+	DHCPMessageType_REQUEST = 3,
+	DHCPMessageType_DECLINE = 4,
+	DHCPMessageType_ACK = 5,
+	DHCPMessageType_NAK = 6,
+	DHCPMessageType_RELEASE = 7,
+	DHCPMessageType_INFORM = 8,
+};
+
+// Client identifiers and host names are stored inline so the lease table never
+// allocates after startup and can be read by the admin thread at any time
+#define MAX_STORED_CLIENT_IDENTIFIER_LENGTH (64)
+#define MAX_STORED_HOSTNAME_LENGTH (64)
+// The lease table has one slot per address, so very large subnets are truncated
+#define MAX_LEASE_TABLE_SIZE (65536)
+
+// An OFFER only holds an address for a short time; the client must REQUEST it
+// (RFC 2131 section 3.1) before the hold expires for it to become a lease
+enum LeaseStates
+{
+	LeaseState_FREE,
+	LeaseState_RESERVED,  // Server entry and reservations (until their client binds)
+	LeaseState_OFFERED,  // In the offer expiry queue
+	LeaseState_BOUND,
+	LeaseState_RELEASED,  // Still assigned to its client (RFC 2131 section 4.3.4), but not in use
+	LeaseState_COUNT,
+};
+extern const char* const ppcsLeaseStateNames[];
+
+struct AddressInUseInformation
+{
+	DWORD dwAddrValue;
+	LeaseStates lsState;
+	BYTE pbClientIdentifier[MAX_STORED_CLIENT_IDENTIFIER_LENGTH];  // Prefix of longer identifiers
+	DWORD dwClientIdentifierSize;  // Server entry is only entry in use without a client ID
+	ULONGLONG qwClientIdentifierHash;  // Of the whole identifier, so identifiers that share the stored prefix stay distinct
+	char pcsHostName[MAX_STORED_HOSTNAME_LENGTH];
+	int iNextClientIdentifierIndex;  // Hash chains are terminated by -1
+	int iNextHostNameIndex;
+	ULONGLONG qwOfferExpireTime;  // GetTickCount64 time (offered leases only)
+	int iOlderOfferIndex;  // Offer expiry queue links (offered leases only)
+	int iNewerOfferIndex;
+	// SYSTEMTIME stExpireTime;  // If lease timeouts are needed
+};
+
+// Written only by the packet thread; readers use lSequence as a seqlock and
+// retry if an update happened while they were copying
+struct LeaseTable
+{
+	volatile LONG lSequence;  // Odd while an update is in progress
+	DWORD dwMinAddrValue;
+	DWORD dwSlotCount;
+	DWORD dwBucketMask;
+	AddressInUseInformation* paiuiSlots;  // Indexed by (dwAddrValue - dwMinAddrValue)
+	int* piClientIdentifierBuckets;
+	int* piHostNameBuckets;
+	DWORD dwLastOfferAddrValue;  // Next-fit cursor (not read by the admin thread)
+	// Offers all have the same hold time, so appending keeps the queue in expiry order
+	int iOldestOfferIndex;
+	int iNewestOfferIndex;
+};
+
+DWORD StoredClientIdentifierSize(const DWORD dwClientIdentifierSize);
+// Also safe for seqlock readers (see LeaseTable)
+int FindLeaseTableIndexOfAddress(const LeaseTable* const plt, const DWORD dwAddrValue);
+int FindLeaseTableIndexOfClientIdentifier(const LeaseTable* const plt, const BYTE* const pbClientIdentifier, const DWORD dwClientIdentifierSize);
+DWORD FindLeaseTableIndexesOfHostName(const LeaseTable* const plt, const char* const pcsHostName, int* const piIndexes, const DWORD dwMaxIndexes);
+
+enum AddressAssignmentModes
+{
+	AddressAssignmentMode_NEXTFIT,  // Next available address after the last one offered
+	AddressAssignmentMode_HASH,  // Address derived from the client identifier (stable across restarts)
+};
+
+// RFC 2131 section 2
+#pragma warning(push)
+#pragma warning(disable : 4200)
+#pragma pack(push, 1)
+struct DHCPMessage
+{
+	BYTE op;
+	BYTE htype;
+	BYTE hlen;
+	BYTE hops;
+	DWORD xid;
+	WORD secs;
+	WORD flags;
+	DWORD ciaddr;
+	DWORD yiaddr;
+	DWORD siaddr;
+	DWORD giaddr;
+	BYTE chaddr[16];
+	BYTE sname[64];
+	BYTE file[128];
+	BYTE options[];
+};
+#pragma pack(pop)
+#pragma warning(pop)
+
+// Largest reply the engine writes (OFFER and ACK); hosts size reply buffers with MAX_DHCP_REPLY_SIZE
+#define MAX_DHCP_REPLY_OPTIONS_SIZE (38)
+#define MAX_DHCP_REPLY_SIZE (sizeof(DHCPMessage) + MAX_DHCP_REPLY_OPTIONS_SIZE)
+
+// T1 and T2 are spread over this percent of the lease time (see GetRenewalTimes)
+#define DEFAULT_RENEWAL_JITTER (20)
+#define MAX_RENEWAL_JITTER (20)  // Keeps T2 below the lease time
+void GetRenewalTimes(const DWORD dwLeaseTime, const DWORD dwRenewalJitter, const BYTE* const pbClientIdentifier, const DWORD dwClientIdentifierSize, DWORD* const pdwRenewalTime, DWORD* const pdwRebindingTime);
+
+#define DEFAULT_LEASE_TIME (1 * 60 * 60)  // One hour
+#define MIN_LEASE_TIME (60)
+#define DEFAULT_OFFER_HOLD_TIME (60)
+#define MAX_OFFER_HOLD_TIME (60 * 60)
+#define MAX_RESERVATIONS (256)
+
+struct Reservation
+{
+	DWORD dwAddrValue;
+	BYTE pbClientIdentifier[MAX_STORED_CLIENT_IDENTIFIER_LENGTH];
+	DWORD dwClientIdentifierSize;
+};
+
+struct ServerConfiguration
+{
+	DWORD dwServerAddr;  // Network order
+	DWORD dwMask;  // Network order
+	DWORD dwMinAddrValue;
+	DWORD dwMaxAddrValue;
+	DWORD dwLeaseTime;  // Seconds
+	DWORD dwRenewalJitter;  // Percent of the lease time
+	DWORD dwOfferHoldTime;  // Seconds
+	AddressAssignmentModes aamMode;
+	DWORD dwReservations;
+	Reservation prReservations[MAX_RESERVATIONS];
+};
+
+enum FlightRecordDecisions
+{
+	FlightRecordDecision_NONE,
+	FlightRecordDecision_DROPPED_INITIALCHECKS,
+	FlightRecordDecision_DROPPED_MESSAGETYPE,
+	FlightRecordDecision_IGNORED_SERVERHOSTNAME,
+	FlightRecordDecision_OFFERED,
+	FlightRecordDecision_NOT_OFFERED_EXHAUSTED,
+	FlightRecordDecision_ACKED,
+	FlightRecordDecision_NAKED_UNKNOWNCLIENT,
+	FlightRecordDecision_NAKED_WRONGADDRESS,
+	FlightRecordDecision_DROPPED_INVALIDREQUEST,
+	FlightRecordDecision_IGNORED_DECLINE,
+	FlightRecordDecision_IGNORED_RELEASE,
+	FlightRecordDecision_IGNORED_INFORM,
+	FlightRecordDecision_DROPPED_UNEXPECTEDTYPE,
+	FlightRecordDecision_RELEASED,
+	FlightRecordDecision_DROPPED_REPLYBUFFER,  // iReplyBufferSize is less than MAX_DHCP_REPLY_SIZE
+	FlightRecordDecision_IGNORED_OTHERSERVER,  // REQUEST selected another server's offer
+	FlightRecordDecision_COUNT,
+};
+extern const char* const ppcsFlightRecordDecisionNames[];
+
+// Also the on-disk format (naturally aligned, all fields as received or in network order);
+// the engine fills in bMessageType, bDecision, and dwAddr and the host does the rest
+struct FlightRecord
+{
+	ULONGLONG qwTimestamp;  // FILETIME (UTC)
+	DWORD dwProcessingNanoseconds;
+	DWORD xid;
+	BYTE chaddr[16];
+	BYTE hlen;
+	BYTE bMessageType;  // 0 if unknown
+	BYTE bDecision;
+	BYTE bReserved;
+	DWORD dwAddr;  // Address offered or acknowledged
+};
+C_ASSERT(40 == sizeof(FlightRecord));
+
+// A configuration and the lease table built for it
+struct ServerState
+{
+	ServerConfiguration scConfiguration;
+	LeaseTable ltAddressesInUse;
+	ServerState* pssNextRetired;
+};
+
+// The packet thread (the one that calls UpdateDHCPEngine and
+// ProcessDHCPClientRequest) owns pssCurrent and replaces it between messages
+// (so a message is always handled by a single configuration). One other
+// thread may read it: that thread queues replacements in pssPending and frees
+// retired states when it holds no references.
+struct ServerStateExchange
+{
+	ServerState* volatile pssCurrent;
+	ServerState* volatile pssPending;
+	ServerState* volatile pssRetired;  // Linked through pssNextRetired
+	volatile LONG lApplying;  // From before pssPending is taken until the replaced state is retired
+};
+
+
+// Reported synchronously by the engine call that caused them (on the packet thread)
+enum DHCPEngineEventTypes
+{
+	DHCPEngineEventType_OFFERED,
+	DHCPEngineEventType_EXHAUSTED,  // No address available to offer
+	DHCPEngineEventType_ACKED,
+	DHCPEngineEventType_NAKED,
+	DHCPEngineEventType_RELEASED,
+	DHCPEngineEventType_RENAMED,  // A bound lease's client sent a different host name
+	DHCPEngineEventType_DROPPED,  // A reload dropped a bound lease (before RELOADED)
+	DHCPEngineEventType_INVALIDMESSAGE,
+	DHCPEngineEventType_OFFERSEXPIRED,
+	DHCPEngineEventType_RELOADED,
+};
+
+struct DHCPEngineEvent
+{
+	DHCPEngineEventTypes deetType;
+	DWORD dwAddr;  // Network order (OFFERED, ACKED, RELEASED, RENAMED, and DROPPED)
+	const char* pcsHostName;  // Client host name, possibly empty (all client events); ACKED, RELEASED, RENAMED, and DROPPED use the lease's name
+	const char* pcsPreviousHostName;  // The lease's name before it changed (RENAMED)
+	const BYTE* pbClientIdentifier;  // Or chaddr (same as pcsHostName); only the stored prefix for DROPPED
+	DWORD dwClientIdentifierSize;
+	const char* pcsDescription;  // INVALIDMESSAGE
+	DWORD dwCount;  // Offers expired (OFFERSEXPIRED) or leases migrated (RELOADED)
+	DWORD dwDropped;  // Leases dropped (RELOADED)
+	DWORD dwLeaseTime;  // Seconds granted by the current configuration (ACKED)
+};
+
+typedef void (*DHCPEngineEventCallback)(void* pvContext, const DHCPEngineEvent* pdeeEvent);
+
+// Everything needed to serve one network; the host owns the memory
+struct DHCPEngine
+{
+	ServerStateExchange sseServerState;
+	char pcsServerHostName[MAX_HOSTNAME_LENGTH];  // Requests from this host are ignored (empty if unknown)
+	DHCPEngineEventCallback pfnEventCallback;  // Optional
+	void* pvEventContext;
+};
+
+// Allocates the lease table; returns false if there is insufficient memory
+bool InitializeDHCPEngine(DHCPEngine* const pde, const ServerConfiguration* const psc, const char* const pcsServerHostName, const DHCPEngineEventCallback pfnEventCallback, void* const pvEventContext);
+// Once no thread is using the engine
+void FreeDHCPEngine(DHCPEngine* const pde);
+
+// Packet thread: expires offers and applies a queued configuration; call at
+// least once a second when no requests arrive (ProcessDHCPClientRequest also
+// does this first). qwNow is a GetTickCount64 time.
+void UpdateDHCPEngine(DHCPEngine* const pde, const ULONGLONG qwNow);
+// Packet thread: handles one request without I/O or allocation. Returns the
+// size of the reply written to pbReply (0 if there is no reply), which the host
+// sends to *pdwReplyAddr (network order) on DHCP client port 68. pfrRecord is
+// optional. Requests are dropped without updating the engine if
+// iReplyBufferSize is less than MAX_DHCP_REPLY_SIZE.
+int ProcessDHCPClientRequest(DHCPEngine* const pde, const BYTE* const pbRequest, const int iRequestSize, const ULONGLONG qwNow, BYTE* const pbReply, const int iReplyBufferSize, DWORD* const pdwReplyAddr, FlightRecord* const pfrRecord);
+
+// Other thread: the lease table is read with the LeaseTable seqlock
+const ServerState* GetCurrentDHCPEngineState(const DHCPEngine* const pde);
+// Other thread: builds a new lease table (existing leases are migrated when
+// the packet thread applies it); returns false if there is insufficient memory
+bool QueueDHCPEngineConfiguration(DHCPEngine* const pde, const ServerConfiguration* const psc);
+// Other thread: true until the packet thread has applied the queued configuration
+bool IsDHCPEngineConfigurationPending(const DHCPEngine* const pde);
+// Other thread: frees replaced states once it holds no references to them
+void FreeRetiredDHCPEngineStates(DHCPEngine* const pde);
+
+#endif  // !defined(DHCPLITE_ENGINE_HEADER)
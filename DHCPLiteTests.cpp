@@ -0,0 +1,329 @@
+// DHCPLite tests - builds DHCPLite.cpp without its main (DHCPLITE_TESTS) so
+// its internals can be checked directly (dynamic DNS against a stand-in DNS
+// server). Returns 0 if every test passes.
+
+#include "DHCPLite.cpp"
+
+#define STAND_IN_TIMEOUT_SECONDS (5)
+
+bool OpenStandInDNSServer(SOCKET* const psStandInSocket, WORD* const pwStandInPort)
+{
+	ASSERT((0 != psStandInSocket) && (0 != pwStandInPort));
+	bool bSuccess = false;
+	*psStandInSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (INVALID_SOCKET != *psStandInSocket)
+	{
+		SOCKADDR_IN saStandInAddress;
+		ZeroMemory(&saStandInAddress, sizeof(saStandInAddress));
+		saStandInAddress.sin_family = AF_INET;
+		saStandInAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		saStandInAddress.sin_port = 0;  // Any free port
+		int iAddressSize = sizeof(saStandInAddress);
+		if ((SOCKET_ERROR != bind(*psStandInSocket, (SOCKADDR*)(&saStandInAddress), sizeof(saStandInAddress))) &&
+			(SOCKET_ERROR != getsockname(*psStandInSocket, (SOCKADDR*)(&saStandInAddress), &iAddressSize)))
+		{
+			*pwStandInPort = saStandInAddress.sin_port;
+			bSuccess = true;
+		}
+		else
+		{
+			VERIFY(0 == closesocket(*psStandInSocket));
+			*psStandInSocket = INVALID_SOCKET;
+		}
+	}
+	return bSuccess;
+}
+
+// Receives one UPDATE and answers it with bResponseCode; returns the message size (0 on timeout)
+int ReceiveDNSUpdateMessage(const SOCKET sStandInSocket, BYTE* const pbMessage, const int iMessageBufferSize, const BYTE bResponseCode)
+{
+	ASSERT((INVALID_SOCKET != sStandInSocket) && (0 != pbMessage) && (DNS_HEADER_SIZE <= iMessageBufferSize));
+	int iMessageSize = 0;
+	fd_set fdsRead;
+	FD_ZERO(&fdsRead);
+	FD_SET(sStandInSocket, &fdsRead);
+	timeval tvTimeout;
+	tvTimeout.tv_sec = STAND_IN_TIMEOUT_SECONDS;
+	tvTimeout.tv_usec = 0;
+	if (1 == select(0, &fdsRead, 0, 0, &tvTimeout))
+	{
+		SOCKADDR_IN saSenderAddress;
+		int iSenderAddressSize = sizeof(saSenderAddress);
+		iMessageSize = recvfrom(sStandInSocket, (char*)pbMessage, iMessageBufferSize, 0, (SOCKADDR*)(&saSenderAddress), &iSenderAddressSize);
+		if (DNS_HEADER_SIZE <= iMessageSize)
+		{
+			// RFC 2136 section 3.8: the response echoes the header with QR set and no records
+			BYTE pbResponse[DNS_HEADER_SIZE];
+			ZeroMemory(pbResponse, sizeof(pbResponse));
+			CopyMemory(pbResponse, pbMessage, 3);
+			pbResponse[2] |= 0x80;
+			pbResponse[3] = bResponseCode;
+			VERIFY(sizeof(pbResponse) == sendto(sStandInSocket, (const char*)pbResponse, sizeof(pbResponse), 0, (SOCKADDR*)(&saSenderAddress), iSenderAddressSize));
+		}
+		else
+		{
+			iMessageSize = 0;
+		}
+	}
+	return iMessageSize;
+}
+
+// The message ID varies from run to run, so comparisons start after it
+bool ExpectDNSUpdateMessage(const SOCKET sStandInSocket, const char* const pcsDescription, const BYTE* const pbExpected, const int iExpectedSize)
+{
+	ASSERT((0 != pcsDescription) && (0 != pbExpected) && (DNS_HEADER_SIZE <= iExpectedSize));
+	BYTE pbMessage[MAX_UDP_MESSAGE_SIZE];
+	const int iMessageSize = ReceiveDNSUpdateMessage(sStandInSocket, pbMessage, sizeof(pbMessage), dns_RCODE_NOERROR);
+	const bool bMatch = (iExpectedSize == iMessageSize) && (0 == memcmp(pbMessage + sizeof(WORD), pbExpected + sizeof(WORD), iExpectedSize - sizeof(WORD)));
+	if (!bMatch)
+	{
+		OUTPUT_ERROR((TEXT("%hs: received %d bytes, expected %d bytes."), pcsDescription, iMessageSize, iExpectedSize));
+		for (int i = 0; i < iMessageSize; i++)
+		{
+			printf(TEXT("%02x%s"), pbMessage[i], (15 == (i % 16)) ? ptsCRLF : TEXT(" "));
+		}
+		OUTPUT((TEXT("")));
+	}
+	return bMatch;
+}
+
+void StartTestDynamicDNSUpdater(DynamicDNSUpdater* const pddu, const WORD wStandInPort)
+{
+	ASSERT(0 != pddu);
+	DynamicDNSConfiguration ddcConfiguration;
+	ZeroMemory(&ddcConfiguration, sizeof(ddcConfiguration));
+	ddcConfiguration.dwServerAddr = htonl(INADDR_LOOPBACK);
+	ddcConfiguration.wServerPort = wStandInPort;
+	strcpy_s(ddcConfiguration.pcsForwardZone, sizeof(ddcConfiguration.pcsForwardZone), "example.test");
+	strcpy_s(ddcConfiguration.pcsReverseZone, sizeof(ddcConfiguration.pcsReverseZone), "0.0.10.in-addr.arpa");
+	VERIFY(StartDynamicDNSUpdater(pddu, &ddcConfiguration));
+}
+
+// An acknowledged lease and its release, as the engine reports them
+bool CheckDynamicDNSWireFormat(const SOCKET sStandInSocket, const WORD wStandInPort)
+{
+	const BYTE pbAddForward[] =
+	{
+		0x00, 0x00, 0x28, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00,  // Header: UPDATE, 1 zone, 2 updates
+		7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 4, 't', 'e', 's', 't', 0, 0x00, 0x06, 0x00, 0x01,  // Zone: example.test SOA IN
+		7, 'c', 'l', 'i', 'e', 'n', 't', '1', 0xc0, 0x0c, 0x00, 0x01, 0x00, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // Delete all A records
+		7, 'c', 'l', 'i', 'e', 'n', 't', '1', 0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x0e, 0x10, 0x00, 0x04, 10, 0, 0, 3,  // Add A 10.0.0.3 (TTL 3600)
+	};
+	const BYTE pbAddReverse[] =
+	{
+		0x00, 0x00, 0x28, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00,
+		1, '0', 1, '0', 2, '1', '0', 7, 'i', 'n', '-', 'a', 'd', 'd', 'r', 4, 'a', 'r', 'p', 'a', 0, 0x00, 0x06, 0x00, 0x01,  // Zone: 0.0.10.in-addr.arpa SOA IN
+		1, '3', 0xc0, 0x0c, 0x00, 0x0c, 0x00, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,  // Delete all PTR records
+		1, '3', 0xc0, 0x0c, 0x00, 0x0c, 0x00, 0x01, 0x00, 0x00, 0x0e, 0x10, 0x00, 0x16,  // Add PTR (TTL 3600)
+		7, 'c', 'l', 'i', 'e', 'n', 't', '1', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 4, 't', 'e', 's', 't', 0,
+	};
+	const BYTE pbRemoveForward[] =
+	{
+		0x00, 0x00, 0x28, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00,
+		7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 4, 't', 'e', 's', 't', 0, 0x00, 0x06, 0x00, 0x01,
+		7, 'c', 'l', 'i', 'e', 'n', 't', '1', 0xc0, 0x0c, 0x00, 0x01, 0x00, 0xfe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 10, 0, 0, 3,  // Delete A 10.0.0.3
+	};
+	const BYTE pbRemoveReverse[] =
+	{
+		0x00, 0x00, 0x28, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00,
+		1, '0', 1, '0', 2, '1', '0', 7, 'i', 'n', '-', 'a', 'd', 'd', 'r', 4, 'a', 'r', 'p', 'a', 0, 0x00, 0x06, 0x00, 0x01,
+		1, '3', 0xc0, 0x0c, 0x00, 0x0c, 0x00, 0xfe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x16,  // Delete this PTR record
+		7, 'c', 'l', 'i', 'e', 'n', 't', '1', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 4, 't', 'e', 's', 't', 0,
+	};
+	DynamicDNSUpdater dduUpdater;
+	StartTestDynamicDNSUpdater(&dduUpdater, wStandInPort);
+	const BYTE pbClientIdentifier[] = { HTYPE_ETHERNET, 0x00, 0x15, 0x5d, 0x00, 0x00, 0x01 };
+	DHCPEngineEvent deeEvent;
+	ZeroMemory(&deeEvent, sizeof(deeEvent));
+	deeEvent.deetType = DHCPEngineEventType_ACKED;
+	deeEvent.dwAddr = DWValuetoIP(0x0a000003);
+	deeEvent.pcsHostName = "client1";
+	deeEvent.pbClientIdentifier = pbClientIdentifier;
+	deeEvent.dwClientIdentifierSize = sizeof(pbClientIdentifier);
+	deeEvent.dwLeaseTime = 3600;
+	HandleDHCPEngineEvent(&dduUpdater, &deeEvent);
+	bool bPassed = ExpectDNSUpdateMessage(sStandInSocket, "Add (forward zone)", pbAddForward, sizeof(pbAddForward)) &&
+		ExpectDNSUpdateMessage(sStandInSocket, "Add (reverse zone)", pbAddReverse, sizeof(pbAddReverse));
+	if (bPassed)
+	{
+		deeEvent.deetType = DHCPEngineEventType_RELEASED;
+		deeEvent.dwLeaseTime = 0;
+		HandleDHCPEngineEvent(&dduUpdater, &deeEvent);
+		bPassed = ExpectDNSUpdateMessage(sStandInSocket, "Remove (forward zone)", pbRemoveForward, sizeof(pbRemoveForward)) &&
+			ExpectDNSUpdateMessage(sStandInSocket, "Remove (reverse zone)", pbRemoveReverse, sizeof(pbRemoveReverse));
+	}
+	StopDynamicDNSUpdater(&dduUpdater);
+	return bPassed;
+}
+
+// Changes queued together are split into messages that fit in MAX_DNS_UDP_MESSAGE_SIZE
+#define TEST_BATCH_CHANGES (40)
+#define TEST_BATCH_MAX_MESSAGES (2 * TEST_BATCH_CHANGES)
+
+bool CheckDynamicDNSBatchSize(const SOCKET sStandInSocket, const WORD wStandInPort)
+{
+	DynamicDNSUpdater dduUpdater;
+	StartTestDynamicDNSUpdater(&dduUpdater, wStandInPort);
+	for (DWORD i = 0; i < TEST_BATCH_CHANGES; i++)
+	{
+		char pcsHostName[MAX_DNS_LABEL_LENGTH + 1];
+		sprintf_s(pcsHostName, sizeof(pcsHostName), "workstation-%03u", i);  // 15 characters
+		QueueDynamicDNSChange(&dduUpdater, DWValuetoIP(0x0a000010 + i), pcsHostName, true, 3600);
+	}
+	bool bPassed = true;
+	DWORD dwForwardChanges = 0;
+	DWORD dwReverseChanges = 0;
+	DWORD dwMessages = 0;
+	while (bPassed && ((dwForwardChanges < TEST_BATCH_CHANGES) || (dwReverseChanges < TEST_BATCH_CHANGES)) && (dwMessages < TEST_BATCH_MAX_MESSAGES))
+	{
+		BYTE pbMessage[MAX_UDP_MESSAGE_SIZE];
+		const int iMessageSize = ReceiveDNSUpdateMessage(sStandInSocket, pbMessage, sizeof(pbMessage), dns_RCODE_NOERROR);
+		// Each add is two updates: the RRset deletion and the new record
+		const DWORD dwChanges = (0 != iMessageSize) ? (((pbMessage[8] << 8) | pbMessage[9]) / 2) : 0;
+		bPassed = (DNS_HEADER_SIZE < iMessageSize) && (iMessageSize <= MAX_DNS_UDP_MESSAGE_SIZE) && (0 != dwChanges) && (dwChanges <= MAX_DYNAMIC_DNS_BATCH_CHANGES);
+		if (bPassed)
+		{
+			// Forward zone messages start with the zone "example.test"
+			if (7 == pbMessage[DNS_HEADER_SIZE])
+			{
+				dwForwardChanges += dwChanges;
+			}
+			else
+			{
+				dwReverseChanges += dwChanges;
+			}
+			OUTPUT((TEXT("    UPDATE of %d bytes with %u change(s)"), iMessageSize, dwChanges));
+		}
+		else
+		{
+			OUTPUT_ERROR((TEXT("Invalid or missing UPDATE message (%d bytes)."), iMessageSize));
+		}
+		dwMessages++;
+	}
+	bPassed = bPassed && (TEST_BATCH_CHANGES == dwForwardChanges) && (TEST_BATCH_CHANGES == dwReverseChanges);
+	StopDynamicDNSUpdater(&dduUpdater);
+	return bPassed;
+}
+
+// A fresh stand-in for each test, so a late message from one test is not seen by the next
+bool CheckWithStandInDNSServer(bool (*pfnCheck)(const SOCKET sStandInSocket, const WORD wStandInPort))
+{
+	ASSERT(0 != pfnCheck);
+	bool bPassed = false;
+	SOCKET sStandInSocket;
+	WORD wStandInPort;
+	if (OpenStandInDNSServer(&sStandInSocket, &wStandInPort))
+	{
+		bPassed = pfnCheck(sStandInSocket, wStandInPort);
+		VERIFY(0 == closesocket(sStandInSocket));
+	}
+	else
+	{
+		OUTPUT_ERROR((TEXT("Unable to open stand-in DNS server socket.")));
+	}
+	return bPassed;
+}
+
+bool TestDynamicDNSWireFormat()
+{
+	return CheckWithStandInDNSServer(CheckDynamicDNSWireFormat);
+}
+
+bool TestDynamicDNSBatchSize()
+{
+	return CheckWithStandInDNSServer(CheckDynamicDNSBatchSize);
+}
+
+// Renewal load for clients that all boot (and get their first lease) at once
+#define SIMULATED_CLIENTS (10000)
+#define SIMULATED_LEASE_PERIODS (8)
+#define SIMULATION_INTERVAL_SECONDS (60)
+
+DWORD SimulatePeakRenewals(const DWORD dwRenewalJitter, DWORD* const pdwRenewals, const DWORD dwIntervals)
+{
+	ASSERT((0 != pdwRenewals) && (0 != dwIntervals));
+	ZeroMemory(pdwRenewals, dwIntervals * sizeof(*pdwRenewals));
+	for (DWORD i = 0; i < SIMULATED_CLIENTS; i++)
+	{
+		// Client identifier as sent by Windows (hardware type then address)
+		const BYTE pbClientIdentifier[] = { HTYPE_ETHERNET, 0x00, 0x15, 0x5d, (BYTE)(i >> 16), (BYTE)(i >> 8), (BYTE)i };
+		DWORD dwRenewalTime;
+		DWORD dwRebindingTime;
+		GetRenewalTimes(DEFAULT_LEASE_TIME, dwRenewalJitter, pbClientIdentifier, sizeof(pbClientIdentifier), &dwRenewalTime, &dwRebindingTime);
+		// Every renewal is acknowledged, which starts a new lease
+		for (DWORD dwTime = dwRenewalTime; dwTime / SIMULATION_INTERVAL_SECONDS < dwIntervals; dwTime += dwRenewalTime)
+		{
+			pdwRenewals[dwTime / SIMULATION_INTERVAL_SECONDS]++;
+		}
+	}
+	DWORD dwPeak = 0;
+	for (DWORD i = 0; i < dwIntervals; i++)
+	{
+		dwPeak = max(dwPeak, pdwRenewals[i]);
+	}
+	return dwPeak;
+}
+
+// Without jitter every client renews in the same minute; the default jitter must cut that peak by at least 10 times
+bool TestRenewalSpread()
+{
+	bool bPassed = false;
+	const DWORD dwIntervals = (DEFAULT_LEASE_TIME * SIMULATED_LEASE_PERIODS) / SIMULATION_INTERVAL_SECONDS;
+	DWORD* const pdwRenewals = (DWORD*)LocalAlloc(LMEM_FIXED, dwIntervals * sizeof(DWORD));
+	if (0 != pdwRenewals)
+	{
+		OUTPUT((TEXT("    %d clients boot together and renew their %d-second leases for %d lease periods:"), SIMULATED_CLIENTS, DEFAULT_LEASE_TIME, SIMULATED_LEASE_PERIODS));
+		const DWORD pdwRenewalJitters[] = { 0, 5, 10, DEFAULT_RENEWAL_JITTER };
+		DWORD pdwPeaks[ARRAY_LENGTH(pdwRenewalJitters)];
+		for (size_t i = 0; i < ARRAY_LENGTH(pdwRenewalJitters); i++)
+		{
+			pdwPeaks[i] = SimulatePeakRenewals(pdwRenewalJitters[i], pdwRenewals, dwIntervals);
+			OUTPUT((TEXT("    Renewal jitter %2u%% - Peak renewals per minute:%u"), pdwRenewalJitters[i], pdwPeaks[i]));
+		}
+		VERIFY(0 == LocalFree(pdwRenewals));
+		bPassed = (SIMULATED_CLIENTS == pdwPeaks[0]) && (pdwPeaks[ARRAY_LENGTH(pdwPeaks) - 1] <= SIMULATED_CLIENTS / 10);
+	}
+	else
+	{
+		OUTPUT_ERROR((TEXT("Insufficient memory for renewal simulation.")));
+	}
+	return bPassed;
+}
+
+
+struct DHCPLiteTest
+{
+	const char* pcsName;
+	bool (*pfnTest)();
+};
+
+int main(int /*argc*/, char** /*argv*/)
+{
+	const DHCPLiteTest pdltTests[] =
+	{
+		{ "Dynamic DNS wire format", TestDynamicDNSWireFormat },
+		{ "Dynamic DNS batch size", TestDynamicDNSBatchSize },
+		{ "Renewal spread", TestRenewalSpread },
+	};
+	DWORD dwFailed = 0;
+	WSADATA wsaData;
+	if (0 == WSAStartup(MAKEWORD(1, 1), &wsaData))
+	{
+		for (size_t i = 0; i < ARRAY_LENGTH(pdltTests); i++)
+		{
+			const bool bPassed = pdltTests[i].pfnTest();
+			OUTPUT((TEXT("%hs - %hs"), bPassed ? "PASSED" : "FAILED", pdltTests[i].pcsName));
+			if (!bPassed)
+			{
+				dwFailed++;
+			}
+		}
+		VERIFY(0 == WSACleanup());
+	}
+	else
+	{
+		OUTPUT_ERROR((TEXT("Unable to initialize WinSock.")));
+		dwFailed++;
+	}
+	return (0 == dwFailed) ? 0 : 1;
+}